@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <chrono>
+#include <vector>
+#include <string>
+
+#include "../Fixed Size Storage Manager/sm.h"
+#include "../Fixed Size Storage Manager/sm_trace.h"
+
+/* The memory manager of "Custom Memory Management Functions APIs" is C */
+extern "C"
+{
+    void mm_init();
+    struct vm_page_family_ *mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+    void *xcalloc_h(struct vm_page_family_ *pg_family, int units);
+    void xfree(void *app_data);
+}
+
+/*
+ * Replays an allocation trace recorded with SM_traceStart/SM_traceStop (or sm_bench --trace=FILE)
+ * against the storage manager, xcalloc and malloc. Every allocator runs in a forked child so that its
+ * footprint is its own.
+ *
+ *   g++ -std=c++17 -O2 -pthread replay.cpp "../Fixed Size Storage Manager/sm.cpp" \
+ *       "../Fixed Size Storage Manager/sm_trace.cpp" mm.o -o replay
+ *
+ * where mm.o is "Custom Memory Management Functions APIs/mm.c" compiled with gcc and glthread.h.
+ *
+ *   ./replay trace.bin --allocator=all --checkpoints=20 --csv=out.csv
+ *
+ * Options:
+ *   --allocator=sm|xcalloc|malloc|all  Allocators to replay against (all)
+ *   --checkpoints=N                    Samples of live bytes and RSS over the trace (20)
+ *   --pool-blocks=N                    Initial blocks of every storage manager pool (1024)
+ *   --csv=FILE                         Append the checkpoints to FILE as CSV
+ *
+ * The records are replayed in trace order on one thread, as fast as possible. The time column of the
+ * checkpoints is the trace time at which they were taken. Fragmentation is the part of the RSS grown
+ * since the replay started which does not hold live bytes. Allocations an allocator cannot serve are
+ * skipped and counted, together with their frees.
+ */
+
+#define MAX_CHECKPOINTS      64
+#define REPLAY_FAMILY_NAME   "replay_bytes"
+
+static struct vm_page_family_ *m_ReplayFamily;          // Family of one byte units xcalloc replays with
+
+typedef enum { ALLOCATOR_SM, ALLOCATOR_XCALLOC, ALLOCATOR_MALLOC, ALLOCATOR_COUNT } Allocator_t;
+
+typedef struct Checkpoint_tag
+{
+    unsigned long long record;                   // Records replayed
+    double traceSeconds;                         // Trace time of the last record replayed
+    unsigned long long liveBytes;                // Requested bytes of the live objects
+    unsigned long long rssBytes;                 // RSS grown since the replay started
+}Checkpoint_t;
+
+typedef struct ReplayResult_tag
+{
+    double seconds;                              // Time spent in the allocator calls and the replay loop
+    unsigned long long ops;
+    unsigned long long skipped;                  // Allocations the allocator could not serve
+    unsigned long long peakLiveBytes;
+    long peakRssKb;                              // Peak RSS grown since the replay started
+    unsigned int checkpointCount;
+    Checkpoint_t checkpoints[MAX_CHECKPOINTS];
+}ReplayResult_t;
+
+static const char *ALLOCATOR_NAMES[] = { "sm", "xcalloc", "malloc" };
+
+static inline unsigned long long nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* Resident set in bytes from /proc/self/statm, 0 if it cannot be read */
+static unsigned long long residentBytes()
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr)
+    {
+        return 0;
+    }
+    unsigned long long pages = 0;
+    unsigned long long resident = 0;
+    if (fscanf(statm, "%llu %llu", &pages, &resident) != 2)
+    {
+        resident = 0;
+    }
+    fclose(statm);
+    return resident * (unsigned long long)sysconf(_SC_PAGESIZE);
+}
+
+static bool readTrace(const char *path, SM_TraceHeader_t *header, vector<SM_TraceRecord_t> *records)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == nullptr)
+    {
+        perror(path);
+        return false;
+    }
+
+    bool isValid = fread(header, sizeof(*header), 1, file) == 1 &&
+                   memcmp(header->magic, SM_TRACE_MAGIC, sizeof(header->magic)) == 0;
+    if (isValid)
+    {
+        records->resize(header->recordCount);
+        isValid = fread(records->data(), sizeof(SM_TraceRecord_t), records->size(), file) == records->size();
+    }
+    for (size_t i = 0; isValid && i < records->size(); i++)
+    {
+        isValid = (*records)[i].objectId < header->objectCount;
+    }
+    fclose(file);
+
+    if (!isValid)
+    {
+        printf("ERROR: %s is not a valid trace\n", path);
+    }
+    return isValid;
+}
+
+static inline void *replayAlloc(Allocator_t allocator, size_t size)
+{
+    switch (allocator)
+    {
+        case ALLOCATOR_SM:
+            return SM_alloc(size);
+        case ALLOCATOR_XCALLOC:
+            return xcalloc_h(m_ReplayFamily, (int)size);
+        default:
+            return malloc(size);
+    }
+}
+
+static inline void replayFree(Allocator_t allocator, void *ptr)
+{
+    switch (allocator)
+    {
+        case ALLOCATOR_SM:
+            SM_dealloc(ptr);
+            break;
+        case ALLOCATOR_XCALLOC:
+            xfree(ptr);
+            break;
+        default:
+            free(ptr);
+            break;
+    }
+}
+
+static ReplayResult_t runReplay(Allocator_t allocator, const SM_TraceHeader_t *header,
+                                const vector<SM_TraceRecord_t> *records, unsigned int checkpoints, unsigned int poolBlocks)
+{
+    ReplayResult_t result;
+    memset(&result, 0, sizeof(result));
+
+    if (allocator == ALLOCATOR_SM)
+    {
+        initStorageManager(poolBlocks, 0, nullptr);
+    }
+    else if (allocator == ALLOCATOR_XCALLOC)
+    {
+        mm_init();
+        m_ReplayFamily = mm_instantiate_new_page_family((char *)REPLAY_FAMILY_NAME, 1);
+    }
+
+    /* Allocated before the baseline so the tables do not count as footprint */
+    vector<void *> objects(header->objectCount, nullptr);
+    vector<uint32_t> sizes(header->objectCount, 0);
+
+    unsigned long long baseline = residentBytes();
+    unsigned long long liveBytes = 0;
+    unsigned long long traceNs = 0;
+    unsigned long long interval = records->size() / checkpoints + 1;
+    unsigned long long elapsed = 0;
+    unsigned long long start = nowNs();
+
+    for (size_t i = 0; i < records->size(); i++)
+    {
+        const SM_TraceRecord_t *record = &(*records)[i];
+        traceNs += record->timeDelta;
+
+        if (record->op == SM_TRACE_ALLOC)
+        {
+            size_t size = record->size > 0 ? record->size : 1;
+            void *ptr = replayAlloc(allocator, size);
+            if (ptr == nullptr)
+            {
+                result.skipped++;
+            }
+            else
+            {
+                /* Touch the block so that its pages count as resident for every allocator */
+                *(volatile char *)ptr = 1;
+                objects[record->objectId] = ptr;
+                sizes[record->objectId] = (uint32_t)size;
+                liveBytes += size;
+                if (liveBytes > result.peakLiveBytes)
+                {
+                    result.peakLiveBytes = liveBytes;
+                }
+                result.ops++;
+            }
+        }
+        else if (objects[record->objectId] != nullptr)
+        {
+            replayFree(allocator, objects[record->objectId]);
+            objects[record->objectId] = nullptr;
+            liveBytes -= sizes[record->objectId];
+            result.ops++;
+        }
+
+        if ((i + 1) % interval == 0 || i + 1 == records->size())
+        {
+            elapsed += nowNs() - start;
+            if (result.checkpointCount < MAX_CHECKPOINTS)
+            {
+                unsigned long long resident = residentBytes();
+                Checkpoint_t *checkpoint = &result.checkpoints[result.checkpointCount++];
+                checkpoint->record = i + 1;
+                checkpoint->traceSeconds = traceNs / 1e9;
+                checkpoint->liveBytes = liveBytes;
+                checkpoint->rssBytes = resident > baseline ? resident - baseline : 0;
+            }
+            start = nowNs();
+        }
+    }
+    result.seconds = elapsed / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long baselineKb = (long)(baseline / 1024);
+    result.peakRssKb = usage.ru_maxrss > baselineKb ? usage.ru_maxrss - baselineKb : 0;
+
+    if (allocator == ALLOCATOR_SM)
+    {
+        destroyStorageManager();
+    }
+    return result;
+}
+
+/* Replays in a child process so the footprint is not inherited from earlier runs */
+static bool runIsolated(Allocator_t allocator, const SM_TraceHeader_t *header, const vector<SM_TraceRecord_t> *records,
+                        unsigned int checkpoints, unsigned int poolBlocks, ReplayResult_t *result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        /* Keep the allocators' own messages out of the result table */
+        if (freopen("/dev/null", "w", stdout) == nullptr)
+        {
+            _exit(1);
+        }
+        ReplayResult_t childResult = runReplay(allocator, header, records, checkpoints, poolBlocks);
+        ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+        _exit(written == (ssize_t)sizeof(childResult) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    size_t received = 0;
+    while (received < sizeof(*result))
+    {
+        ssize_t bytes = read(fds[0], (char *)result + received, sizeof(*result) - received);
+        if (bytes <= 0)
+        {
+            break;
+        }
+        received += bytes;
+    }
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return pid > 0 && received == sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static double fragmentation(const Checkpoint_t *checkpoint)
+{
+    if (checkpoint->rssBytes == 0 || checkpoint->liveBytes >= checkpoint->rssBytes)
+    {
+        return 0;
+    }
+    return 1.0 - (double)checkpoint->liveBytes / checkpoint->rssBytes;
+}
+
+int main(int argc, char **argv)
+{
+    vector<Allocator_t> allocators = { ALLOCATOR_SM, ALLOCATOR_XCALLOC, ALLOCATOR_MALLOC };
+    unsigned int checkpoints = 20;
+    unsigned int poolBlocks = 1024;
+    const char *tracePath = nullptr;
+    const char *csvPath = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = strchr(argv[i], '=');
+        string option = value ? string(argv[i], value - argv[i]) : string(argv[i]);
+        value = value ? value + 1 : "";
+
+        if (option == "--allocator")
+        {
+            allocators.clear();
+            for (int a = 0; a < ALLOCATOR_COUNT; a++)
+            {
+                if (strcmp(value, "all") == 0 || strcmp(value, ALLOCATOR_NAMES[a]) == 0)
+                {
+                    allocators.push_back((Allocator_t)a);
+                }
+            }
+        }
+        else if (option == "--checkpoints")
+        {
+            checkpoints = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--pool-blocks")
+        {
+            poolBlocks = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--csv")
+        {
+            csvPath = value;
+        }
+        else if (argv[i][0] != '-' && tracePath == nullptr)
+        {
+            tracePath = argv[i];
+        }
+        else
+        {
+            tracePath = nullptr;
+            break;
+        }
+    }
+
+    if (tracePath == nullptr || allocators.empty() || checkpoints == 0 || checkpoints > MAX_CHECKPOINTS)
+    {
+        printf("Usage: %s TRACE [--allocator=sm|xcalloc|malloc|all] [--checkpoints=1..%d] [--pool-blocks=N]\n"
+               "          [--csv=FILE]\n", argv[0], MAX_CHECKPOINTS);
+        return 1;
+    }
+
+    SM_TraceHeader_t header;
+    vector<SM_TraceRecord_t> records;
+    if (!readTrace(tracePath, &header, &records))
+    {
+        return 1;
+    }
+
+    FILE *csv = nullptr;
+    if (csvPath != nullptr)
+    {
+        csv = fopen(csvPath, "a");
+        if (csv == nullptr)
+        {
+            perror(csvPath);
+            return 1;
+        }
+        if (ftell(csv) == 0)
+        {
+            fprintf(csv, "trace,allocator,record,trace_seconds,live_bytes,rss_bytes,fragmentation\n");
+        }
+    }
+
+    printf("trace=%s records=%llu objects=%u threads=%u\n\n", tracePath, (unsigned long long)header.recordCount,
+           header.objectCount, header.threadCount);
+
+    vector<ReplayResult_t> results(allocators.size());
+    vector<bool> isReplayed(allocators.size(), false);
+    printf("%-8s %10s %10s %14s %12s %10s %10s\n", "alloc", "seconds", "Mops/s", "peak live KB", "peak RSS KB",
+           "max frag", "skipped");
+    for (size_t a = 0; a < allocators.size(); a++)
+    {
+        ReplayResult_t *result = &results[a];
+        if (!runIsolated(allocators[a], &header, &records, checkpoints, poolBlocks, result))
+        {
+            printf("ERROR: %s replay failed\n", ALLOCATOR_NAMES[allocators[a]]);
+            continue;
+        }
+        isReplayed[a] = true;
+
+        double maxFragmentation = 0;
+        for (unsigned int c = 0; c < result->checkpointCount; c++)
+        {
+            double value = fragmentation(&result->checkpoints[c]);
+            /* Everything is fragmentation once the trace freed all objects, which says nothing */
+            if (result->checkpoints[c].liveBytes > 0 && value > maxFragmentation)
+            {
+                maxFragmentation = value;
+            }
+            if (csv != nullptr)
+            {
+                fprintf(csv, "%s,%s,%llu,%.6f,%llu,%llu,%.4f\n", tracePath, ALLOCATOR_NAMES[allocators[a]],
+                        result->checkpoints[c].record, result->checkpoints[c].traceSeconds,
+                        result->checkpoints[c].liveBytes, result->checkpoints[c].rssBytes, value);
+            }
+        }
+        printf("%-8s %10.3f %10.2f %14llu %12ld %9.1f%% %10llu\n", ALLOCATOR_NAMES[allocators[a]], result->seconds,
+               result->seconds > 0 ? result->ops / result->seconds / 1e6 : 0, result->peakLiveBytes / 1024,
+               result->peakRssKb, maxFragmentation * 100, result->skipped);
+    }
+
+    /* Footprint over the trace: live KB, then RSS KB and fragmentation of every allocator */
+    printf("\n%10s %10s %12s", "record", "trace s", "live KB");
+    for (size_t a = 0; a < allocators.size(); a++)
+    {
+        printf(" %10s %6s", (string(ALLOCATOR_NAMES[allocators[a]]) + " KB").c_str(), "frag");
+    }
+    printf("\n");
+    for (unsigned int c = 0; c < MAX_CHECKPOINTS; c++)
+    {
+        const Checkpoint_t *reference = nullptr;
+        for (size_t a = 0; a < allocators.size() && reference == nullptr; a++)
+        {
+            if (isReplayed[a] && c < results[a].checkpointCount)
+            {
+                reference = &results[a].checkpoints[c];
+            }
+        }
+        if (reference == nullptr)
+        {
+            break;
+        }
+
+        printf("%10llu %10.3f %12llu", reference->record, reference->traceSeconds, reference->liveBytes / 1024);
+        for (size_t a = 0; a < allocators.size(); a++)
+        {
+            if (isReplayed[a] && c < results[a].checkpointCount)
+            {
+                printf(" %10llu %5.1f%%", results[a].checkpoints[c].rssBytes / 1024,
+                       fragmentation(&results[a].checkpoints[c]) * 100);
+            }
+            else
+            {
+                printf(" %10s %6s", "-", "-");
+            }
+        }
+        printf("\n");
+    }
+
+    if (csv != nullptr)
+    {
+        fclose(csv);
+    }
+    return 0;
+}
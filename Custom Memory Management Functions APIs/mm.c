@@ -6,17 +6,42 @@
 #include "mm.h"
 #include <assert.h>
 #include <unistd.h> // For sleep function
+#include <time.h>   /*For clock_gettime*/
+#include <pthread.h>
 
 
 
 
 static vm_page_for_families_t *first_vm_page_for_families = NULL;
 static size_t SYSTEM_PAGE_SIZE = 0;
+static vm_page_t *global_retained_pages = NULL;    /*Single system pages of no family, newest first*/
+static uint32_t global_retained_page_count = 0;
+static vm_page_family_t *page_family_hash_table[MM_PAGE_FAMILY_HASH_BUCKETS];   /*Families by name*/
+static uint32_t page_family_count = 0;             /*Registered families, the next family_id*/
+static mm_thread_heap_t *abandoned_thread_heaps = NULL;     /*Heaps of exited threads*/
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;    /*Registered families and abandoned heaps*/
+static pthread_mutex_t global_page_cache_lock = PTHREAD_MUTEX_INITIALIZER;  /*global_retained_pages*/
+static pthread_once_t thread_heap_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_heap_key;              /*Gives the heap up when its thread exits*/
+static __thread mm_thread_heap_t *thread_heap = NULL;
+
+static void
+mm_thread_heap_exit(void *arg);
+
+static void
+mm_drain_deferred_frees(mm_thread_heap_t *heap);
+
+static void
+mm_create_thread_heap_key(){
+
+    pthread_key_create(&thread_heap_key, mm_thread_heap_exit);
+}
 
 void
 mm_init(){
 
     SYSTEM_PAGE_SIZE = getpagesize();
+    pthread_once(&thread_heap_key_once, mm_create_thread_heap_key);
 }
 
 static inline uint32_t
@@ -29,6 +54,14 @@ mm_max_page_allocatable_memory(int units){
 #define MAX_PAGE_ALLOCATABLE_MEMORY(units) \
     (mm_max_page_allocatable_memory(units))
 
+/*Smallest number of system pages whose VM page can hold size bytes*/
+static inline uint32_t
+mm_vm_page_units_for_size(uint64_t size){
+
+    return (uint32_t)((size + offset_of(vm_page_t, page_memory) +
+                SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE);
+}
+
 
 /*Function to request VM page from kernel*/
 static void *
@@ -45,7 +78,8 @@ mm_get_new_vm_page_from_kernel(int units){
         printf("Error : VM Page allocation Failed\n");
         return NULL;
     }
-    memset(vm_page, 0, units * SYSTEM_PAGE_SIZE);
+    /*Anonymous mappings are zero filled, touching them here would only
+     * fault in every page of a big mapping*/
     return (void *)vm_page;
 }
 
@@ -59,6 +93,189 @@ mm_return_vm_page_to_kernel (void *vm_page, int units){
     }
 }
 
+static uint64_t
+mm_now_ms(){
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*Retained page lists are singly linked through vm_page->next, newest
+ * first, so the pages past a point are all older than it*/
+static void
+mm_push_retained_page(vm_page_t **list, uint32_t *count,
+        vm_page_t *vm_page, uint64_t now){
+
+    vm_page->retained_at = now;
+    vm_page->prev = NULL;
+    vm_page->next = *list;
+    *list = vm_page;
+    (*count)++;
+}
+
+/*Unmaps the pages of a retained list from *link on*/
+static void
+mm_release_retained_pages_from(vm_page_t **link, uint32_t *count){
+
+    vm_page_t *vm_page = *link;
+    *link = NULL;
+
+    while(vm_page){
+        vm_page_t *next = vm_page->next;
+        mm_return_vm_page_to_kernel((void *)vm_page, vm_page->units);
+        (*count)--;
+        vm_page = next;
+    }
+}
+
+/*Unmaps the pages of a retained list which are older than cutoff*/
+static void
+mm_decay_retained_list(vm_page_t **list, uint32_t *count, uint64_t cutoff){
+
+    vm_page_t **link = list;
+
+    while(*link && (*link)->retained_at >= cutoff)
+        link = &(*link)->next;
+    mm_release_retained_pages_from(link, count);
+}
+
+/*Unmaps the pages retained before cutoff by the heap families of heap
+ * and by the global cache*/
+static void
+mm_release_retained_pages_before(mm_thread_heap_t *heap, uint64_t cutoff){
+
+    vm_page_family_t *vm_page_family_curr = NULL;
+    vm_page_for_families_t *vm_page_for_families_curr = NULL;
+
+    for(vm_page_for_families_curr = heap ? heap->family_pages : NULL;
+            vm_page_for_families_curr;
+            vm_page_for_families_curr = vm_page_for_families_curr->next){
+
+        ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_families_curr, vm_page_family_curr){
+
+            mm_decay_retained_list(&vm_page_family_curr->retained_pages,
+                    &vm_page_family_curr->retained_page_count, cutoff);
+
+        } ITERATE_PAGE_FAMILIES_END(vm_page_for_families_curr, vm_page_family_curr);
+    }
+
+    pthread_mutex_lock(&global_page_cache_lock);
+    mm_decay_retained_list(&global_retained_pages,
+            &global_retained_page_count, cutoff);
+    pthread_mutex_unlock(&global_page_cache_lock);
+}
+
+/*At most once per MM_RETAINED_PAGE_DECAY_MS, unmaps the retained pages
+ * which were not reused within that time*/
+static void
+mm_decay_retained_pages(mm_thread_heap_t *heap, uint64_t now){
+
+    if(now - heap->last_retained_page_decay < MM_RETAINED_PAGE_DECAY_MS)
+        return;
+    heap->last_retained_page_decay = now;
+
+    mm_release_retained_pages_before(heap, now - MM_RETAINED_PAGE_DECAY_MS);
+}
+
+/*Gets a VM page of units system pages for vm_page_family. A page the
+ * family retained is reused first, then one of the global cache, and
+ * single system pages are mapped MM_VM_PAGE_BATCH at a time with the
+ * rest of the batch going to the global cache. The page is not zeroed*/
+static vm_page_t *
+mm_get_vm_page_for_family(vm_page_family_t *vm_page_family, uint32_t units){
+
+    vm_page_t **link;
+    vm_page_t *vm_page;
+
+    for(link = &vm_page_family->retained_pages; *link; link = &(*link)->next){
+        if((*link)->units == units){
+            vm_page = *link;
+            *link = vm_page->next;
+            vm_page_family->retained_page_count--;
+            return vm_page;
+        }
+    }
+
+    if(units != 1)
+        return mm_get_new_vm_page_from_kernel(units);
+
+    pthread_mutex_lock(&global_page_cache_lock);
+    vm_page = global_retained_pages;
+    if(vm_page){
+        global_retained_pages = vm_page->next;
+        global_retained_page_count--;
+    }
+    pthread_mutex_unlock(&global_page_cache_lock);
+
+    if(vm_page)
+        return vm_page;
+
+    /*Mapped without the lock, other threads may have refilled the cache
+     * meanwhile, which only makes it longer*/
+    char *batch = mm_get_new_vm_page_from_kernel(MM_VM_PAGE_BATCH);
+    if(!batch)
+        return NULL;
+
+    uint64_t now = mm_now_ms();
+    uint32_t i;
+    pthread_mutex_lock(&global_page_cache_lock);
+    for(i = MM_VM_PAGE_BATCH - 1; i > 0; i--){
+        vm_page = (vm_page_t *)(batch + i * SYSTEM_PAGE_SIZE);
+        vm_page->units = 1;
+        mm_push_retained_page(&global_retained_pages,
+                &global_retained_page_count, vm_page, now);
+    }
+    pthread_mutex_unlock(&global_page_cache_lock);
+    return (vm_page_t *)batch;
+}
+
+/*Keeps an empty VM page, already unlinked from its family, for reuse.
+ * Once the family retained MM_FAMILY_RETAINED_PAGES pages, a single
+ * system page goes to the global cache, which is trimmed to its low mark
+ * when it passes its high mark; bigger pages are unmapped*/
+static void
+mm_retain_vm_page(vm_page_t *vm_page){
+
+    vm_page_family_t *vm_page_family = vm_page->pg_family;
+    uint64_t now = mm_now_ms();
+
+    if(vm_page_family->retained_page_count < MM_FAMILY_RETAINED_PAGES){
+        mm_push_retained_page(&vm_page_family->retained_pages,
+                &vm_page_family->retained_page_count, vm_page, now);
+    }
+    else if(vm_page->units == 1){
+        pthread_mutex_lock(&global_page_cache_lock);
+        mm_push_retained_page(&global_retained_pages,
+                &global_retained_page_count, vm_page, now);
+
+        if(global_retained_page_count > MM_GLOBAL_RETAINED_PAGES_HIGH){
+            vm_page_t **link = &global_retained_pages;
+            uint32_t i;
+            for(i = 0; i < MM_GLOBAL_RETAINED_PAGES_LOW; i++)
+                link = &(*link)->next;
+            mm_release_retained_pages_from(link, &global_retained_page_count);
+        }
+        pthread_mutex_unlock(&global_page_cache_lock);
+    }
+    else {
+        mm_return_vm_page_to_kernel((void *)vm_page, vm_page->units);
+    }
+
+    mm_decay_retained_pages(vm_page_family->heap, now);
+}
+
+/**
+ * The function `mm_trim_retained_pages` unmaps every empty VM page kept for reuse by the heap
+ * families of the calling thread and in the global cache. The pages retained by other threads are
+ * left to their own decay.
+ */
+void
+mm_trim_retained_pages(){
+
+    mm_release_retained_pages_before(thread_heap, UINT64_MAX);
+}
+
 static int
 mm_get_hard_internal_memory_frag_size(
         block_meta_data_t *first,
@@ -68,6 +285,56 @@ mm_get_hard_internal_memory_frag_size(
     return (int)((unsigned long)second - (unsigned long)(next_block));
 }
 
+/*FNV-1a of the part of the name which lookups compare*/
+static uint32_t
+mm_page_family_name_hash(char *struct_name){
+
+    uint32_t hash = 2166136261u;
+    uint32_t i;
+
+    for(i = 0; i < MM_MAX_STRUCT_NAME && struct_name[i]; i++){
+        hash ^= (unsigned char)struct_name[i];
+        hash *= 16777619u;
+    }
+    return hash & (MM_PAGE_FAMILY_HASH_BUCKETS - 1);
+}
+
+static void
+mm_init_free_block_bins(vm_page_family_t *vm_page_family){
+
+    uint32_t i;
+    for(i = 0; i < MM_FREE_BIN_COUNT; i++)
+        init_glthread(&vm_page_family->free_block_bins[i]);
+    vm_page_family->non_empty_bins = 0;
+}
+
+/*O(1) : the block goes on the head of the bin of its size*/
+static void
+mm_add_free_block_meta_data_to_free_block_list(
+        vm_page_family_t *vm_page_family,
+        block_meta_data_t *free_block){
+
+    assert(free_block->is_free == MM_TRUE);
+    uint32_t bin = mm_free_bin_index(free_block->block_size);
+    init_glthread(&free_block->priority_thread_glue);
+    glthread_add_next(&vm_page_family->free_block_bins[bin],
+            &free_block->priority_thread_glue);
+    vm_page_family->non_empty_bins |= (uint64_t)1 << bin;
+}
+
+/*Must be called before the size of the block changes, as the size
+ * tells which bin the block is in*/
+static void
+mm_remove_free_block_meta_data_from_free_block_list(
+        vm_page_family_t *vm_page_family,
+        block_meta_data_t *free_block){
+
+    uint32_t bin = mm_free_bin_index(free_block->block_size);
+    remove_glthread(&free_block->priority_thread_glue);
+    if(!vm_page_family->free_block_bins[bin].right)
+        vm_page_family->non_empty_bins &= ~((uint64_t)1 << bin);
+}
+
 static void
 mm_union_free_blocks(block_meta_data_t *first,
         block_meta_data_t *second){
@@ -75,6 +342,11 @@ mm_union_free_blocks(block_meta_data_t *first,
     assert(first->is_free == MM_TRUE &&
             second->is_free == MM_TRUE);
 
+    /*The second block is absorbed, it must not stay in the free block list*/
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(second);
+    mm_remove_free_block_meta_data_from_free_block_list(
+            hosting_page->pg_family, second);
+
     first->block_size += sizeof(block_meta_data_t) +
         second->block_size;
 
@@ -85,15 +357,20 @@ mm_union_free_blocks(block_meta_data_t *first,
 }
 
 vm_page_t *
-allocate_vm_page(vm_page_family_t *vm_page_family){
+allocate_vm_page(vm_page_family_t *vm_page_family, uint32_t units){
+
+    vm_page_t *vm_page = mm_get_vm_page_for_family(vm_page_family, units);
+
+    if(!vm_page)
+        return NULL;
 
-    vm_page_t *vm_page = mm_get_new_vm_page_from_kernel(1);
-   
     /*Initialize lower most Meta block of the VM page*/
     MARK_VM_PAGE_EMPTY(vm_page);
 
+    vm_page->units = units;
+    vm_page->is_direct_mapped = MM_FALSE;
     vm_page->block_meta_data.block_size =
-        mm_max_page_allocatable_memory(1);
+        mm_max_page_allocatable_memory(units);
     vm_page->block_meta_data.offset =
         offset_of(vm_page_t, block_meta_data);
     init_glthread(&vm_page->block_meta_data.priority_thread_glue);
@@ -118,9 +395,8 @@ allocate_vm_page(vm_page_family_t *vm_page_family){
     return vm_page;
 }
 
-void
-mm_vm_page_delete_and_free(
-        vm_page_t *vm_page){
+static void
+mm_vm_page_unlink(vm_page_t *vm_page){
 
     vm_page_family_t *vm_page_family =
         vm_page->pg_family;
@@ -133,7 +409,6 @@ mm_vm_page_delete_and_free(
             vm_page->next->prev = NULL;
         vm_page->next = NULL;
         vm_page->prev = NULL;
-        mm_return_vm_page_to_kernel((void *)vm_page, 1);
         return;
     }
 
@@ -142,13 +417,22 @@ mm_vm_page_delete_and_free(
     if(vm_page->next)
         vm_page->next->prev = vm_page->prev;
     vm_page->prev->next = vm_page->next;
-    mm_return_vm_page_to_kernel((void *)vm_page, 1);
+}
+
+void
+mm_vm_page_delete_and_free(
+        vm_page_t *vm_page){
+
+    mm_vm_page_unlink(vm_page);
+    mm_return_vm_page_to_kernel((void *)vm_page, vm_page->units);
 }
 
 void
 mm_print_vm_page_details(vm_page_t *vm_page){
 
     printf("\t\t next = %p, prev = %p\n", vm_page->next, vm_page->prev);
+    printf("\t\t units = %u%s\n", vm_page->units,
+            vm_page->is_direct_mapped ? ", direct mapped" : "");
     printf("\t\t page family = %s\n", vm_page->pg_family->struct_name);
 
     uint32_t j = 0;
@@ -166,62 +450,188 @@ mm_print_vm_page_details(vm_page_t *vm_page){
 }
 
 
-void
+/*Free entry of a list of pages of families. A page is added in front
+ * when the first one is full*/
+static vm_page_family_t *
+mm_new_page_family_slot(vm_page_for_families_t **first_page_for_families){
+
+    vm_page_family_t *vm_page_family_curr = NULL;
+    vm_page_for_families_t *new_vm_page_for_families = NULL;
+    uint32_t count = 0;
+
+    if(*first_page_for_families){
+
+        ITERATE_PAGE_FAMILIES_BEGIN((*first_page_for_families), vm_page_family_curr){
+
+            count++;
+
+        } ITERATE_PAGE_FAMILIES_END((*first_page_for_families), vm_page_family_curr);
+
+        if(count < MAX_FAMILIES_PER_VM_PAGE)
+            return vm_page_family_curr;
+    }
+
+    new_vm_page_for_families = 
+        (vm_page_for_families_t *)mm_get_new_vm_page_from_kernel(1);
+    if(!new_vm_page_for_families)
+        return NULL;
+    new_vm_page_for_families->next = *first_page_for_families;
+    *first_page_for_families = new_vm_page_for_families;
+    return &new_vm_page_for_families->vm_page_family[0];
+}
+
+static void
+mm_init_page_family(vm_page_family_t *vm_page_family,
+        char *struct_name, uint32_t struct_size,
+        uint32_t family_id, mm_thread_heap_t *heap){
+
+    strncpy(vm_page_family->struct_name, struct_name,
+            MM_MAX_STRUCT_NAME);
+    vm_page_family->struct_size = struct_size;
+    vm_page_family->family_id = family_id;
+    vm_page_family->first_page = NULL;
+    vm_page_family->hash_next = NULL;
+    vm_page_family->heap_families = NULL;
+    vm_page_family->next_heap_family = NULL;
+    vm_page_family->heap = heap;
+    vm_page_family->retained_pages = NULL;
+    vm_page_family->retained_page_count = 0;
+    mm_init_free_block_bins(vm_page_family);
+}
+
+/* Registers a page family and returns its handle, to be passed to
+ * xcalloc_h so that allocations skip the lookup by name. If struct_name is
+ * already registered with the same size, its family is returned, so that
+ * threads racing to register a family all get the same one*/
+vm_page_family_t *
 mm_instantiate_new_page_family(
     char *struct_name,
     uint32_t struct_size){
 
 
     vm_page_family_t *vm_page_family_curr = NULL;
-    vm_page_for_families_t *new_vm_page_for_families = NULL;
 
     if(struct_size > SYSTEM_PAGE_SIZE){
         
         printf("Error : %s() Structure %s Size exceeds system page size\n",
             __FUNCTION__, struct_name);
-        return;
+        return NULL;
     }
 
-    if(!first_vm_page_for_families){
+    pthread_mutex_lock(&registry_lock);
 
-        first_vm_page_for_families = 
-            (vm_page_for_families_t *)mm_get_new_vm_page_from_kernel(1);
-        first_vm_page_for_families->next = NULL;
-        strncpy(first_vm_page_for_families->vm_page_family[0].struct_name, 
-        struct_name, MM_MAX_STRUCT_NAME);
-        first_vm_page_for_families->vm_page_family[0].struct_size = struct_size;
-        first_vm_page_for_families->vm_page_family[0].first_page = NULL;
-        init_glthread(&first_vm_page_for_families->vm_page_family[0].free_block_priority_list_head);
-        return;
+    vm_page_family_curr = lookup_page_family_by_name(struct_name);
+
+    if(vm_page_family_curr){
+
+        if(vm_page_family_curr->struct_size != struct_size){
+            printf("Error : %s() Structure %s is already registered with size %u\n",
+                __FUNCTION__, struct_name, vm_page_family_curr->struct_size);
+            vm_page_family_curr = NULL;
+        }
+        pthread_mutex_unlock(&registry_lock);
+        return vm_page_family_curr;
     }
 
-	vm_page_family_curr = lookup_page_family_by_name(struct_name);
+    vm_page_family_curr = mm_new_page_family_slot(&first_vm_page_for_families);
 
-	if(vm_page_family_curr) {
-		assert(0);
-	}
+    if(vm_page_family_curr){
 
-    uint32_t count = 0;
+        mm_init_page_family(vm_page_family_curr, struct_name, struct_size,
+                page_family_count++, NULL);
 
-    ITERATE_PAGE_FAMILIES_BEGIN(first_vm_page_for_families, vm_page_family_curr){
+        /*Lookups do not lock, the family is complete before it is linked*/
+        uint32_t bucket = mm_page_family_name_hash(struct_name);
+        vm_page_family_curr->hash_next = page_family_hash_table[bucket];
+        __atomic_store_n(&page_family_hash_table[bucket], vm_page_family_curr,
+                __ATOMIC_RELEASE);
+    }
 
-	    count++;
+    pthread_mutex_unlock(&registry_lock);
+    return vm_page_family_curr;
+}
+
+/*Heap of the calling thread. A new thread adopts the heap of an exited
+ * one if there is any, together with its live blocks. Other threads free
+ * into an abandoned heap under its lock, so it is adopted under it too*/
+static mm_thread_heap_t *
+mm_get_thread_heap(){
+
+    mm_thread_heap_t *heap = thread_heap;
 
-    } ITERATE_PAGE_FAMILIES_END(first_vm_page_for_families, vm_page_family_curr);
+    if(heap)
+        return heap;
 
-    if(count == MAX_FAMILIES_PER_VM_PAGE){
+    pthread_mutex_lock(&registry_lock);
+    heap = abandoned_thread_heaps;
+    if(heap)
+        abandoned_thread_heaps = heap->next;
+    pthread_mutex_unlock(&registry_lock);
 
-        new_vm_page_for_families = 
-            (vm_page_for_families_t *)mm_get_new_vm_page_from_kernel(1);
-        new_vm_page_for_families->next = first_vm_page_for_families;
-        first_vm_page_for_families = new_vm_page_for_families;
+    if(heap){
+        pthread_mutex_lock(&heap->lock);
+        __atomic_store_n(&heap->is_abandoned, MM_FALSE, __ATOMIC_SEQ_CST);
+        mm_drain_deferred_frees(heap);
+        pthread_mutex_unlock(&heap->lock);
+    }
+    else {
+        heap = (mm_thread_heap_t *)mm_get_new_vm_page_from_kernel(
+                mm_vm_page_units_for_size(sizeof(mm_thread_heap_t)));
+        if(!heap)
+            return NULL;
+        pthread_mutex_init(&heap->lock, NULL);
     }
+    heap->next = NULL;
 
-    strncpy(vm_page_family_curr->struct_name, struct_name,
-            MM_MAX_STRUCT_NAME);
-    vm_page_family_curr->struct_size = struct_size;
-    vm_page_family_curr->first_page = NULL;
-    init_glthread(&vm_page_family_curr->free_block_priority_list_head);
+    thread_heap = heap;
+    pthread_setspecific(thread_heap_key, heap);
+    return heap;
+}
+
+/*Heap family of heap for the registered vm_page_family, created on the
+ * first allocation of the thread from it*/
+static vm_page_family_t *
+mm_get_heap_family(mm_thread_heap_t *heap, vm_page_family_t *vm_page_family){
+
+    uint32_t family_id = vm_page_family->family_id;
+
+    if(family_id < heap->family_capacity && heap->families[family_id])
+        return heap->families[family_id];
+
+    if(family_id >= heap->family_capacity){
+
+        /*Families are indexed by id, double the table*/
+        uint32_t units = mm_vm_page_units_for_size(
+                (uint64_t)(family_id + 1) * 2 * sizeof(vm_page_family_t *));
+        vm_page_family_t **families = mm_get_new_vm_page_from_kernel(units);
+        if(!families)
+            return NULL;
+
+        if(heap->families){
+            memcpy(families, heap->families,
+                    heap->family_capacity * sizeof(vm_page_family_t *));
+            mm_return_vm_page_to_kernel(heap->families, heap->families_units);
+        }
+        heap->families = families;
+        heap->families_units = units;
+        heap->family_capacity = units * SYSTEM_PAGE_SIZE / sizeof(vm_page_family_t *);
+    }
+
+    vm_page_family_t *heap_family = mm_new_page_family_slot(&heap->family_pages);
+    if(!heap_family)
+        return NULL;
+
+    mm_init_page_family(heap_family, vm_page_family->struct_name,
+            vm_page_family->struct_size, family_id, heap);
+    heap->families[family_id] = heap_family;
+
+    /*Linked to the registered family only for the print functions*/
+    pthread_mutex_lock(&registry_lock);
+    heap_family->next_heap_family = vm_page_family->heap_families;
+    __atomic_store_n(&vm_page_family->heap_families, heap_family,
+            __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&registry_lock);
+    return heap_family;
 }
 
 void
@@ -246,40 +656,10 @@ mm_print_registered_page_families(){
     }
 }
 
-static int
-free_blocks_comparison_function(
-        void *_block_meta_data1,
-        void *_block_meta_data2){
-
-    block_meta_data_t *block_meta_data1 =
-        (block_meta_data_t *)_block_meta_data1;
-
-    block_meta_data_t *block_meta_data2 =
-        (block_meta_data_t *)_block_meta_data2;
-
-    if(block_meta_data1->block_size > block_meta_data2->block_size)
-        return -1;
-    else if(block_meta_data1->block_size < block_meta_data2->block_size)
-        return 1;
-    return 0;
-}
-
-static void
-mm_add_free_block_meta_data_to_free_block_list(
-        vm_page_family_t *vm_page_family,
-        block_meta_data_t *free_block){
-
-    assert(free_block->is_free == MM_TRUE);
-    glthread_priority_insert(&vm_page_family->free_block_priority_list_head,
-            &free_block->priority_thread_glue,
-            free_blocks_comparison_function,
-            offset_of(block_meta_data_t, priority_thread_glue));
-}
-
 static vm_page_t *
-mm_family_new_page_add(vm_page_family_t *vm_page_family){
+mm_family_new_page_add(vm_page_family_t *vm_page_family, uint32_t units){
 
-    vm_page_t *vm_page = allocate_vm_page(vm_page_family);
+    vm_page_t *vm_page = allocate_vm_page(vm_page_family, units);
 
     if(!vm_page)
         return NULL;
@@ -312,9 +692,10 @@ mm_split_free_data_block_for_allocation(
     uint32_t remaining_size =
         block_meta_data->block_size - size;
 
+    mm_remove_free_block_meta_data_from_free_block_list(
+            vm_page_family, block_meta_data);
     block_meta_data->is_free = MM_FALSE;
     block_meta_data->block_size = size;
-    remove_glthread(&block_meta_data->priority_thread_glue);
     /*block_meta_data->offset =  ??*/
 
     /*Case 1 : No Split*/
@@ -373,14 +754,40 @@ mm_allocate_free_data_block(
     vm_page_t *vm_page = NULL;
     block_meta_data_t *block_meta_data = NULL;
 
-    block_meta_data_t *biggest_block_meta_data =
-        mm_get_biggest_free_block_page_family(vm_page_family);
+    /*Every block of the bins from first_bin on is at least req_size
+     * bytes, so the lowest non empty one of them gives a fitting block
+     * with one ctz*/
+    uint32_t first_bin = req_size ? mm_free_bin_index(req_size - 1) + 1 : 0;
+    uint64_t fitting_bins = first_bin < MM_FREE_BIN_COUNT ?
+        vm_page_family->non_empty_bins & (~(uint64_t)0 << first_bin) : 0;
+
+    if(fitting_bins){
+        uint32_t bin = __builtin_ctzll(fitting_bins);
+        block_meta_data = glthread_to_block_meta_data(
+                vm_page_family->free_block_bins[bin].right);
+    }
+    else if(first_bin > 0 &&
+            (vm_page_family->non_empty_bins & ((uint64_t)1 << (first_bin - 1)))){
+        /*Only the bin of req_size itself is left, its blocks may be
+         * smaller than the request*/
+        glthread_t *curr;
+        for(curr = vm_page_family->free_block_bins[first_bin - 1].right; curr; curr = curr->right){
+            if(glthread_to_block_meta_data(curr)->block_size >= req_size){
+                block_meta_data = glthread_to_block_meta_data(curr);
+                break;
+            }
+        }
+    }
+
+    if(!block_meta_data){
 
-    if(!biggest_block_meta_data ||
-            biggest_block_meta_data->block_size < req_size){
+        /*Time to add a new page to Page family to satisfy the request,
+         * spanning as many system pages as the request needs*/
+        vm_page = mm_family_new_page_add(vm_page_family,
+                mm_vm_page_units_for_size(req_size));
 
-        /*Time to add a new page to Page family to satisfy the request*/
-        vm_page = mm_family_new_page_add(vm_page_family);
+        if(!vm_page)
+            return NULL;
 
         /*Allocate the free block from this page now*/
         status = mm_split_free_data_block_for_allocation(vm_page_family,
@@ -391,37 +798,53 @@ mm_allocate_free_data_block(
 
         return NULL;
     }
-    /*The biggest block meta data can satisfy the request*/
-    if(biggest_block_meta_data){
-        status = mm_split_free_data_block_for_allocation(vm_page_family,
-                biggest_block_meta_data, req_size);
-    }
+    /*The block found in the bins can satisfy the request*/
+    status = mm_split_free_data_block_for_allocation(vm_page_family,
+            block_meta_data, req_size);
 
     if(status)
-        return biggest_block_meta_data;
+        return block_meta_data;
 
     return NULL;
 }
 
+/*Requests above MAX_PAGE_ALLOCATABLE_MEMORY(MM_MAX_VM_PAGE_UNITS) get a
+ * VM page of their own. Its only block is never split or merged, and is
+ * already zero as the mapping is fresh: no retained page is that big*/
+static block_meta_data_t *
+mm_allocate_direct_mapped_block(
+        vm_page_family_t *vm_page_family,
+        uint32_t req_size){
+
+    vm_page_t *vm_page = allocate_vm_page(vm_page_family,
+            mm_vm_page_units_for_size(req_size));
+
+    if(!vm_page)
+        return NULL;
+
+    vm_page->is_direct_mapped = MM_TRUE;
+    vm_page->block_meta_data.is_free = MM_FALSE;
+    vm_page->block_meta_data.block_size = req_size;
+    return &vm_page->block_meta_data;
+}
+
 vm_page_family_t *
 lookup_page_family_by_name(char *struct_name){
 
-    vm_page_family_t *vm_page_family_curr = NULL;
-    vm_page_for_families_t *vm_page_for_families_curr = NULL;
+    vm_page_family_t *vm_page_family_curr;
 
-    for(vm_page_for_families_curr = first_vm_page_for_families;
-            vm_page_for_families_curr;
-            vm_page_for_families_curr = vm_page_for_families_curr->next){
+    for(vm_page_family_curr = __atomic_load_n(
+                &page_family_hash_table[mm_page_family_name_hash(struct_name)],
+                __ATOMIC_ACQUIRE);
+            vm_page_family_curr;
+            vm_page_family_curr = vm_page_family_curr->hash_next){
 
-        ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_families_curr, vm_page_family_curr){
+        if(strncmp(vm_page_family_curr->struct_name,
+                    struct_name,
+                    MM_MAX_STRUCT_NAME) == 0){
 
-            if(strncmp(vm_page_family_curr->struct_name,
-                        struct_name,
-                        MM_MAX_STRUCT_NAME) == 0){
-
-                return vm_page_family_curr;
-            }
-        } ITERATE_PAGE_FAMILIES_END(vm_page_for_families_curr, vm_page_family_curr);
+            return vm_page_family_curr;
+        }
     }
     return NULL;
 }
@@ -436,12 +859,14 @@ lookup_page_family_by_name(char *struct_name){
  * array that represents the name of a structure for which memory needs to be allocated.
  * @param units The `units` parameter in the `xcalloc` function represents the number of elements of a
  * specific size that you want to allocate memory for. It is used to calculate the total memory
- * required based on the size of the structure specified by `struct_name`.
+ * required based on the size of the structure specified by `struct_name`. Requests may span several
+ * system pages; above MAX_PAGE_ALLOCATABLE_MEMORY(MM_MAX_VM_PAGE_UNITS) bytes the block gets its own
+ * mapping.
  * 
  * @return The function `xcalloc` is returning a pointer to the allocated memory block. If the memory
  * allocation is successful, it returns a pointer to the start of the allocated memory block. If there
  * is an error during the allocation process, such as the structure not being registered with the
- * Memory Manager or the memory request exceeding the page size, it returns NULL.
+ * Memory Manager or the mapping failing, it returns NULL.
  */
 void *
 xcalloc(char *struct_name, int units){
@@ -457,17 +882,63 @@ xcalloc(char *struct_name, int units){
          return NULL;
      }
 
-     if(units * pg_family->struct_size > MAX_PAGE_ALLOCATABLE_MEMORY(1)){
+     return xcalloc_h(pg_family, units);
+}
+
+/**
+ * The function `xcalloc_h` is `xcalloc` for the page family returned by
+ * `mm_instantiate_new_page_family`, without looking the family up by name.
+ *
+ * @return A pointer to the zeroed block, or NULL if `pg_family` is NULL or the request cannot be
+ * served.
+ */
+void *
+xcalloc_h(vm_page_family_t *pg_family, int units){
+
+     if(!pg_family){
 
-         printf("Error : Memory Requested Exceeds Page Size\n");
+         printf("Error : No page family given to xcalloc_h\n");
          return NULL;
      }
-     
-     /*Find the page which can satisfy the request*/
+
+     mm_thread_heap_t *heap = mm_get_thread_heap();
+
+     if(!heap)
+         return NULL;
+
+     if(__atomic_load_n(&heap->deferred_frees, __ATOMIC_RELAXED))
+         mm_drain_deferred_frees(heap);
+
+     /*Blocks are carved from the pages of the calling thread only*/
+     pg_family = mm_get_heap_family(heap, pg_family);
+
+     if(!pg_family)
+         return NULL;
+
+     uint64_t req_size = (uint64_t)units * pg_family->struct_size;
+
+     if(units <= 0 || req_size > UINT32_MAX - SYSTEM_PAGE_SIZE){
+
+         printf("Error : Invalid Memory Request of %d units of %s\n",
+                 units, pg_family->struct_name);
+         return NULL;
+     }
+
      block_meta_data_t *free_block_meta_data = NULL;
 
+     if(req_size > MAX_PAGE_ALLOCATABLE_MEMORY(MM_MAX_VM_PAGE_UNITS)){
+
+         free_block_meta_data = mm_allocate_direct_mapped_block(
+                 pg_family, (uint32_t)req_size);
+
+         if(free_block_meta_data)
+             return (void *)(free_block_meta_data + 1);
+         return NULL;
+     }
+
+     /*Find the page which can satisfy the request*/
      free_block_meta_data = mm_allocate_free_data_block(
-             pg_family, units * pg_family->struct_size);
+             pg_family, (uint32_t)req_size);
 
      if(free_block_meta_data){
          memset((char *)(free_block_meta_data + 1), 0, 
@@ -490,6 +961,11 @@ mm_free_blocks(block_meta_data_t *to_be_free_block){
 
     vm_page_family_t *vm_page_family = hosting_page->pg_family;
 
+    if(hosting_page->is_direct_mapped){
+        mm_vm_page_delete_and_free(hosting_page);
+        return NULL;
+    }
+
     return_block = to_be_free_block;
 
     to_be_free_block->is_free = MM_TRUE;
@@ -508,7 +984,8 @@ mm_free_blocks(block_meta_data_t *to_be_free_block){
         /* Block being freed is the upper most free data block
          * in a VM data page, check of hard internal fragmented
          * memory and merge*/
-        char *end_address_of_vm_page = (char *)((char *)hosting_page + SYSTEM_PAGE_SIZE);
+        char *end_address_of_vm_page = (char *)((char *)hosting_page +
+                hosting_page->units * SYSTEM_PAGE_SIZE);
         char *end_address_of_free_data_block =
             (char *)(to_be_free_block + 1) + to_be_free_block->block_size;
         int internal_mem_fragmentation = (int)((unsigned long)end_address_of_vm_page -
@@ -526,12 +1003,19 @@ mm_free_blocks(block_meta_data_t *to_be_free_block){
     block_meta_data_t *prev_block = PREV_META_BLOCK(to_be_free_block);
 
     if(prev_block && prev_block->is_free){
+        /*The previous block is already in the free block list, take
+         * it out while its size still tells its bin, so that it is
+         * reinserted with its new size*/
+        mm_remove_free_block_meta_data_from_free_block_list(
+                vm_page_family, prev_block);
         mm_union_free_blocks(prev_block, to_be_free_block);
         return_block = prev_block;
     }
 
     if(mm_is_vm_page_empty(hosting_page)){
-        mm_vm_page_delete_and_free(hosting_page);
+        /*Keep the page for the next allocations rather than unmapping it*/
+        mm_vm_page_unlink(hosting_page);
+        mm_retain_vm_page(hosting_page);
         return NULL;
     }
     mm_add_free_block_meta_data_to_free_block_list(
@@ -555,7 +1039,80 @@ xfree(void *app_data){
         (block_meta_data_t *)((char *)app_data - sizeof(block_meta_data_t));
 
     assert(block_meta_data->is_free == MM_FALSE);
-    mm_free_blocks(block_meta_data);
+
+    vm_page_t *hosting_page = MM_GET_PAGE_FROM_META_BLOCK(block_meta_data);
+    mm_thread_heap_t *heap = hosting_page->pg_family->heap;
+
+    if(heap == thread_heap){
+        mm_free_blocks(block_meta_data);
+        return;
+    }
+
+    /*The thread of the heap exited, nobody would drain a deferred free*/
+    if(__atomic_load_n(&heap->is_abandoned, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&heap->lock);
+        if(heap->is_abandoned){
+            mm_free_blocks(block_meta_data);
+            pthread_mutex_unlock(&heap->lock);
+            return;
+        }
+        pthread_mutex_unlock(&heap->lock);
+    }
+
+    /*The pages of the block belong to another thread, which frees it on
+     * its next xcalloc*/
+    block_meta_data_t *head = __atomic_load_n(&heap->deferred_frees, __ATOMIC_RELAXED);
+    do {
+        block_meta_data->priority_thread_glue.left = (glthread_t *)head;
+    } while(!__atomic_compare_exchange_n(&heap->deferred_frees, &head,
+                block_meta_data, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+    /*The owner may have exited and drained the heap between the check
+     * and the push. Then the block is drained here*/
+    if(__atomic_load_n(&heap->is_abandoned, __ATOMIC_SEQ_CST)){
+        pthread_mutex_lock(&heap->lock);
+        if(heap->is_abandoned)
+            mm_drain_deferred_frees(heap);
+        pthread_mutex_unlock(&heap->lock);
+    }
+}
+
+/*Frees the blocks other threads freed to heap. Called by its owner, or
+ * under the heap lock while it has no owner*/
+static void
+mm_drain_deferred_frees(mm_thread_heap_t *heap){
+
+    block_meta_data_t *block_meta_data =
+        __atomic_exchange_n(&heap->deferred_frees, NULL, __ATOMIC_SEQ_CST);
+
+    while(block_meta_data){
+        block_meta_data_t *next =
+            (block_meta_data_t *)block_meta_data->priority_thread_glue.left;
+        init_glthread(&block_meta_data->priority_thread_glue);
+        mm_free_blocks(block_meta_data);
+        block_meta_data = next;
+    }
+}
+
+/*Key destructor of a thread which allocated. Its heap is given up with
+ * its live blocks, and is adopted by the next thread that allocates.
+ * Until then other threads free its blocks directly under its lock*/
+static void
+mm_thread_heap_exit(void *arg){
+
+    mm_thread_heap_t *heap = (mm_thread_heap_t *)arg;
+
+    pthread_mutex_lock(&heap->lock);
+    __atomic_store_n(&heap->is_abandoned, MM_TRUE, __ATOMIC_SEQ_CST);
+    mm_drain_deferred_frees(heap);
+    mm_release_retained_pages_before(heap, UINT64_MAX);
+    thread_heap = NULL;
+    pthread_mutex_unlock(&heap->lock);
+
+    pthread_mutex_lock(&registry_lock);
+    heap->next = abandoned_thread_heaps;
+    abandoned_thread_heaps = heap;
+    pthread_mutex_unlock(&registry_lock);
 }
 
 vm_bool_t
@@ -574,6 +1131,7 @@ mm_is_vm_page_empty(vm_page_t *vm_page){
 void mm_print_block_usage() {
     vm_page_t *vm_page_curr;
     vm_page_family_t *vm_page_family_curr;
+    vm_page_family_t *heap_family_curr;
     block_meta_data_t *block_meta_data_curr;
     uint32_t total_block_count, free_block_count,
              occupied_block_count;
@@ -583,13 +1141,19 @@ void mm_print_block_usage() {
     char *color_block_usage = "\x1b[1m\x1b[95m"; // Bright magenta
     char *color_reset = "\x1b[0m"; // Reset color
 
-    ITERATE_PAGE_FAMILIES_BEGIN(first_vm_page_for_families, vm_page_family_curr) {
+    vm_page_for_families_t *vm_page_for_families_curr;
+
+    for(vm_page_for_families_curr = first_vm_page_for_families;
+            vm_page_for_families_curr;
+            vm_page_for_families_curr = vm_page_for_families_curr->next)
+    ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_families_curr, vm_page_family_curr) {
         total_block_count = 0;
         free_block_count = 0;
         application_memory_usage = 0;
         occupied_block_count = 0;
 
-        ITERATE_VM_PAGE_BEGIN(vm_page_family_curr, vm_page_curr) {
+        ITERATE_HEAP_FAMILIES_BEGIN(vm_page_family_curr, heap_family_curr)
+        ITERATE_VM_PAGE_BEGIN(heap_family_curr, vm_page_curr) {
             ITERATE_VM_PAGE_ALL_BLOCKS_BEGIN(vm_page_curr, block_meta_data_curr) {
                 total_block_count++;
 
@@ -609,19 +1173,21 @@ void mm_print_block_usage() {
                     occupied_block_count++;
                 }
             } ITERATE_VM_PAGE_ALL_BLOCKS_END(vm_page_curr, block_meta_data_curr);
-        } ITERATE_VM_PAGE_END(vm_page_family_curr, vm_page_curr);
+        } ITERATE_VM_PAGE_END(heap_family_curr, vm_page_curr);
+        ITERATE_HEAP_FAMILIES_END(vm_page_family_curr, heap_family_curr);
 
         // Output block usage information with improved formatting and color highlighting
         printf("%s%-20s   Total Block Count: %-4u    Free Block Count: %-4u    Occupied Block Count: %-4u    AppMemUsage: %u%s\n",
                 color_block_usage, vm_page_family_curr->struct_name, total_block_count,
                 free_block_count, occupied_block_count, application_memory_usage, color_reset);
-    } ITERATE_PAGE_FAMILIES_END(first_vm_page_for_families, vm_page_family_curr);
+    } ITERATE_PAGE_FAMILIES_END(vm_page_for_families_curr, vm_page_family_curr);
 }
 
 void mm_print_memory_usage(char *struct_name) {
     uint32_t i = 0;
     vm_page_t *vm_page = NULL;
     vm_page_family_t *vm_page_family_curr;
+    vm_page_family_t *heap_family_curr;
     uint32_t number_of_struct_families = 0;
     uint32_t cumulative_vm_pages_claimed_from_kernel = 0;
 
@@ -636,7 +1202,12 @@ void mm_print_memory_usage(char *struct_name) {
     printf("%s                             Memory Usage Summary                           %s\n", color_summary, color_reset);
     printf("%s=============================================================================================================================================================================%s\n\n", color_summary, color_reset);
 
-    ITERATE_PAGE_FAMILIES_BEGIN(first_vm_page_for_families, vm_page_family_curr) {
+    vm_page_for_families_t *vm_page_for_families_curr;
+
+    for(vm_page_for_families_curr = first_vm_page_for_families;
+            vm_page_for_families_curr;
+            vm_page_for_families_curr = vm_page_for_families_curr->next)
+    ITERATE_PAGE_FAMILIES_BEGIN(vm_page_for_families_curr, vm_page_family_curr) {
         if (struct_name && strncmp(struct_name, vm_page_family_curr->struct_name,
                                    strlen(vm_page_family_curr->struct_name))) {
             continue;
@@ -650,14 +1221,16 @@ void mm_print_memory_usage(char *struct_name) {
 
         i = 0;
 
-        ITERATE_VM_PAGE_BEGIN(vm_page_family_curr, vm_page) {
-            cumulative_vm_pages_claimed_from_kernel++;
+        ITERATE_HEAP_FAMILIES_BEGIN(vm_page_family_curr, heap_family_curr)
+        ITERATE_VM_PAGE_BEGIN(heap_family_curr, vm_page) {
+            cumulative_vm_pages_claimed_from_kernel += vm_page->units;
             mm_print_vm_page_details(vm_page);
-        } ITERATE_VM_PAGE_END(vm_page_family_curr, vm_page);
+        } ITERATE_VM_PAGE_END(heap_family_curr, vm_page);
+        ITERATE_HEAP_FAMILIES_END(vm_page_family_curr, heap_family_curr);
 
         printf("\n");
         usleep(1000000); // Delay for 1 second
-    } ITERATE_PAGE_FAMILIES_END(first_vm_page_for_families, vm_page_family_curr);
+    } ITERATE_PAGE_FAMILIES_END(vm_page_for_families_curr, vm_page_family_curr);
 
     printf("\n%s==================================================================================================================================================================%s\n", color_summary, color_reset);
     printf("%sTotal VM Pages in Use: %-12u%s\n", color_summary, cumulative_vm_pages_claimed_from_kernel, color_reset);
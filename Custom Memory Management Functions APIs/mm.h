@@ -5,6 +5,7 @@
 
 
 #include <stdint.h> /*uint32_t*/
+#include <pthread.h>
 
 typedef enum {
 
@@ -17,6 +18,9 @@ typedef struct block_meta_data_{
     vm_bool_t is_free;
     uint32_t block_size;
     uint32_t offset;    /*offset from the start of the page*/
+    /*Free block : link in its free block bin. Allocated block freed by
+     * another thread : left is the next block of the deferred free stack
+     * of the owning heap*/
     glthread_t priority_thread_glue;
     struct block_meta_data_ *prev_block;
     struct block_meta_data_ *next_block;
@@ -29,11 +33,15 @@ GLTHREAD_TO_STRUCT(glthread_to_block_meta_data,
 
 /*Forward Declaration*/
 struct vm_page_family_;
+struct mm_thread_heap_;
 
 typedef struct vm_page_{
     struct vm_page_ *next;
     struct vm_page_ *prev;
     struct vm_page_family_ *pg_family; /*back pointer*/
+    uint32_t units;                    /*System pages mapped for this VM page*/
+    vm_bool_t is_direct_mapped;        /*Holds a single object and is unmapped when it is freed*/
+    uint64_t retained_at;              /*Milliseconds timestamp when the page was retained empty*/
     block_meta_data_t block_meta_data;
     char page_memory[0];
 } vm_page_t;
@@ -62,12 +70,62 @@ vm_bool_t
 mm_is_vm_page_empty(vm_page_t *vm_page);
 
 #define MM_MAX_STRUCT_NAME 32
+#define MM_PAGE_FAMILY_HASH_BUCKETS 256    /*Power of two*/
+
+/*A VM page of a family spans up to MM_MAX_VM_PAGE_UNITS system pages, so
+ * requests up to that size are carved out of the family's pages. Bigger
+ * requests get a mapping of their own which xfree gives back with one
+ * munmap*/
+#define MM_MAX_VM_PAGE_UNITS 16
+
+/*VM pages which become empty are retained instead of unmapped, first by
+ * their family and, for single system pages, in a global cache shared by
+ * all families. The global cache is trimmed down to its low mark once it
+ * passes the high mark, and pages retained longer than
+ * MM_RETAINED_PAGE_DECAY_MS are unmapped. Single system pages are mapped
+ * MM_VM_PAGE_BATCH at a time*/
+#define MM_FAMILY_RETAINED_PAGES        4
+#define MM_GLOBAL_RETAINED_PAGES_HIGH   64
+#define MM_GLOBAL_RETAINED_PAGES_LOW    32
+#define MM_RETAINED_PAGE_DECAY_MS       1000
+#define MM_VM_PAGE_BATCH                16
+
+/*Free blocks of a page family are kept in segregated bins by size.
+ * Sizes below MM_FREE_BIN_LINEAR_MAX get a bin every 8 bytes, larger
+ * sizes 4 bins per power of two. The last bin also holds every size
+ * above the range of the others*/
+#define MM_FREE_BIN_COUNT       64
+#define MM_FREE_BIN_LINEAR_MAX  64
+
+static inline uint32_t
+mm_free_bin_index(uint32_t size){
+
+    if(size < MM_FREE_BIN_LINEAR_MAX)
+        return size >> 3;
+
+    uint32_t log = 31 - __builtin_clz(size);
+    uint32_t bin = (MM_FREE_BIN_LINEAR_MAX >> 3) + (log - 6) * 4 +
+        ((size >> (log - 2)) & 3);
+    return bin < MM_FREE_BIN_COUNT ? bin : MM_FREE_BIN_COUNT - 1;
+}
+
+/*A registered page family owns no pages. Every thread allocating from it
+ * gets a heap family of its own, a copy of the registered family whose
+ * pages, bins and retained pages only that thread touches*/
 typedef struct vm_page_family_{
 
     char struct_name[MM_MAX_STRUCT_NAME];
     uint32_t struct_size;
+    uint32_t family_id;                 /*Index of the registered family, shared by its heap families*/
     vm_page_t *first_page;
-    glthread_t free_block_priority_list_head;
+    struct vm_page_family_ *hash_next;  /*Next family in the same bucket of the name hash table*/
+    struct vm_page_family_ *heap_families;      /*Registered family : heap families of all threads*/
+    struct vm_page_family_ *next_heap_family;   /*Heap family : next one of the same registered family*/
+    struct mm_thread_heap_ *heap;               /*Heap family : owning heap. NULL if registered*/
+    vm_page_t *retained_pages;      /*Empty pages kept for reuse, newest first*/
+    uint32_t retained_page_count;
+    uint64_t non_empty_bins;    /*Bit i is set when free_block_bins[i] has a block*/
+    glthread_t free_block_bins[MM_FREE_BIN_COUNT];
 } vm_page_family_t;
 
 typedef struct vm_page_for_families_{
@@ -76,6 +134,24 @@ typedef struct vm_page_for_families_{
     vm_page_family_t vm_page_family[0];
 } vm_page_for_families_t;
 
+/*Allocation state of a thread. Blocks are only carved from and merged
+ * into the pages of its heap families, so neither takes a lock. A block
+ * freed by another thread is pushed on deferred_frees, which the owner
+ * drains on its next xcalloc. When the thread exits its heap is kept
+ * with its live blocks and adopted by the next new thread*/
+typedef struct mm_thread_heap_{
+
+    struct mm_thread_heap_ *next;       /*All heaps, or the abandoned ones*/
+    block_meta_data_t *deferred_frees;  /*Lock-free stack of blocks freed by other threads*/
+    vm_page_family_t **families;        /*Heap families by family_id, NULL until first used*/
+    uint32_t family_capacity;           /*Entries of families*/
+    uint32_t families_units;            /*System pages mapped for families*/
+    vm_page_for_families_t *family_pages;   /*Pages holding the heap families*/
+    uint64_t last_retained_page_decay;  /*Milliseconds timestamp of the last decay pass*/
+    pthread_mutex_t lock;               /*Held to free into the heap while it has no owner*/
+    vm_bool_t is_abandoned;             /*Its thread exited and no thread adopted it yet*/
+} mm_thread_heap_t;
+
 #define MAX_FAMILIES_PER_VM_PAGE   \
     ((SYSTEM_PAGE_SIZE - sizeof(vm_page_for_families_t *))/sizeof(vm_page_family_t))
 
@@ -83,17 +159,24 @@ static inline block_meta_data_t *
 mm_get_biggest_free_block_page_family(
         vm_page_family_t *vm_page_family){
 
-    glthread_t *biggest_free_block_glue =
-        vm_page_family->free_block_priority_list_head.right;
+    if(!vm_page_family->non_empty_bins)
+        return NULL;
 
-    if(biggest_free_block_glue)
-        return glthread_to_block_meta_data(biggest_free_block_glue);
+    /*Only the highest non empty bin can hold the biggest block*/
+    uint32_t bin = 63 - __builtin_clzll(vm_page_family->non_empty_bins);
+    block_meta_data_t *biggest_block = NULL;
+    glthread_t *curr;
 
-    return NULL;
+    for(curr = vm_page_family->free_block_bins[bin].right; curr; curr = curr->right){
+        block_meta_data_t *block = glthread_to_block_meta_data(curr);
+        if(!biggest_block || block->block_size > biggest_block->block_size)
+            biggest_block = block;
+    }
+    return biggest_block;
 }
 
 vm_page_t *
-allocate_vm_page();
+allocate_vm_page(vm_page_family_t *vm_page_family, uint32_t units);
 
 #define MARK_VM_PAGE_EMPTY(vm_page_t_ptr)                                 \
     vm_page_t_ptr->block_meta_data.next_block = NULL;                     \
@@ -124,13 +207,31 @@ vm_page_t_ptr->block_meta_data.is_free = MM_TRUE
 {                                                                                   \
     uint32_t _count = 0;                                                             \
     for(curr = (vm_page_family_t *)&vm_page_for_families_ptr->vm_page_family[0];    \
-        curr->struct_size && _count < MAX_FAMILIES_PER_VM_PAGE;                      \
+        _count < MAX_FAMILIES_PER_VM_PAGE && curr->struct_size;                      \
         curr++,_count++){
 
 #define ITERATE_PAGE_FAMILIES_END(vm_page_for_families_ptr, curr)   }}
 
+/*Heap families of a registered family. Other threads may add to the list
+ * while it is walked*/
+#define ITERATE_HEAP_FAMILIES_BEGIN(vm_page_family_ptr, curr)                         \
+{                                                                                     \
+    for(curr = __atomic_load_n(&vm_page_family_ptr->heap_families, __ATOMIC_ACQUIRE); \
+        curr;                                                                         \
+        curr = __atomic_load_n(&curr->next_heap_family, __ATOMIC_ACQUIRE)){
+
+#define ITERATE_HEAP_FAMILIES_END(vm_page_family_ptr, curr)   }}
+
 vm_page_family_t *
 lookup_page_family_by_name(char *struct_name);
 
+vm_page_family_t *
+mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+
+void *
+xcalloc_h(vm_page_family_t *pg_family, int units);
+
 void mm_vm_page_delete_and_free(vm_page_t *vm_page);
+
+void mm_trim_retained_pages();
 #endif /**/
\ No newline at end of file
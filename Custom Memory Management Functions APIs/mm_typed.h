@@ -0,0 +1,68 @@
+#ifndef __MM_TYPED__
+#define __MM_TYPED__
+
+#include <stdint.h>
+
+/*C++ layer on top of xcalloc. MM_Family<T> keeps the handle of the page
+ * family of T in a static, so its allocations never look the family up
+ * by name:
+ *
+ *   MM_Family<Packet>::init("Packet");
+ *   Packet *packets = MM_Family<Packet>::alloc(16);
+ *   MM_Family<Packet>::free(packets);
+ *
+ * The memory manager is C, so it is declared here with C linkage*/
+extern "C" {
+
+    struct vm_page_family_;
+
+    struct vm_page_family_ *
+    mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+
+    void *
+    xcalloc_h(struct vm_page_family_ *pg_family, int units);
+
+    void
+    xfree(void *app_data);
+}
+
+template<class T>
+class MM_Family
+{
+public:
+    /*Registers the family of T under struct_name, or takes the family
+     * already registered under it. Returns false if it cannot be
+     * registered. Threads may call it concurrently: the lookup and the
+     * registration are one step under the registry lock*/
+    static bool init(const char *struct_name)
+    {
+        struct vm_page_family_ *family =
+            mm_instantiate_new_page_family((char *)struct_name, sizeof(T));
+        if(family)
+            __atomic_store_n(&handle, family, __ATOMIC_RELEASE);
+        return family != nullptr;
+    }
+
+    /*Zeroed array of units T, NULL before init or if it cannot be served*/
+    static T *alloc(int units = 1)
+    {
+        return (T *)xcalloc_h(family(), units);
+    }
+
+    static void free(T *ptr)
+    {
+        xfree(ptr);
+    }
+
+    static struct vm_page_family_ *family()
+    {
+        return __atomic_load_n(&handle, __ATOMIC_ACQUIRE);
+    }
+
+private:
+    static_assert(sizeof(T) <= UINT32_MAX, "MM_Family cannot hold structures of 4 GB or more");
+
+    static inline struct vm_page_family_ *handle = nullptr;
+};
+
+#endif /**/
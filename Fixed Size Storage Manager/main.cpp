@@ -1,135 +1,977 @@
 #include<iostream>
-#include<Windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 #include "sm.h"
+#include "sm_trace.h"
 
+/*
+ * Allocator benchmark. Every configuration runs in a forked child so that its peak RSS is its own.
+ *
+ *   ./sm_bench --allocator=both --sizes=uniform --free-order=random --threads=1,2,4,8 --csv=out.csv
+ *
+ * The stress workload checks thread safety rather than speed. Its threads swap blocks through one
+ * shared array, so most blocks are freed by another thread than the one that allocated them, and
+ * verify the contents of every block they free. The threads start together by allocating one block
+ * of every size class in [min-size, max-size], in the same order, so they race to create the pools
+ * not in INITIAL_POOLS. Small pools make them grow the pools concurrently:
+ *
+ *   ./sm_bench --allocator=sm --workload=stress --pool-blocks=16 --min-size=8 --max-size=4096 --threads=2,4,8
+ *   ./sm_bench --allocator=sm --workload=stress --pool-blocks=1 --min-size=8 --max-size=16384 --threads=8
+ *
+ * The chase workload measures the effect of slab coloring. It links the first --hot blocks of each
+ * pool in one random cycle and times dependent loads through it. The colors=1 vs colors=64 table at
+ * SM_Config_t in sm.h comes from
+ *
+ *   for k in 1 4 16; do for c in 1 64; do
+ *     ./sm_bench --allocator=sm --workload=chase --chase=caches --chase-pools=32 --hot=$k \
+ *                --min-size=64 --align=64 --pool-blocks=1 --colors=$c --ops=20000000
+ *   done; done
+ *   for k in 1 4; do for c in 1 64; do
+ *     ./sm_bench --allocator=sm --workload=chase --chase=classes --hot=$k \
+ *                --min-size=64 --max-size=16384 --pool-blocks=1 --colors=$c --ops=20000000
+ *   done; done
+ *
+ * Options:
+ *   --allocator=sm|malloc|both         Allocators to compare (both)
+ *   --workload=churn|prodcons|chase|stress
+ *                                      Each thread allocates and frees its own blocks, producer threads
+ *                                      hand blocks to consumer threads which free them, one thread chases
+ *                                      pointers through blocks of many pools, or threads exchange blocks
+ *                                      through a shared array and check them (churn)
+ *   --chase=caches|classes             chase: the pools are --chase-pools object caches of min-size byte
+ *                                      objects, or every size class in [min-size, max-size] (caches)
+ *   --chase-pools=N                    chase: Object caches created (32)
+ *   --hot=N                            chase: Blocks taken from each pool (1)
+ *   --sizes=uniform|zipf|pow2          Size distribution in [min-size, max-size] (uniform)
+ *   --min-size=N --max-size=N          Size range in bytes (8, 128)
+ *   --free-order=lifo|fifo|random      Which live block a churn thread frees next (random)
+ *   --threads=N[,N...]                 Thread counts to sweep (1)
+ *   --ops=N                            Allocations per thread, or accesses of the chase (1000000)
+ *   --live=N                           Live blocks per churn thread, or shared slots per stress thread (10000)
+ *   --sample=N                         Time every Nth operation for the latency percentiles (16)
+ *   --pool-blocks=N                    Initial blocks of every pool (POOL_SIZE)
+ *   --policy=lifo|lowest               Allocation policy of the sm pools, see SM_AllocationPolicy_t (lifo)
+ *   --colors=N                         Slab colors of the sm pools, see SM_Config_t::colorCount
+ *   --align=N                          Align the blocks of the sm pools in [min-size, max-size], and of
+ *                                      the chase object caches, to N bytes (natural alignment)
+ *   --tune                             Print the pools and initial blocks recommended by each sm run on
+ *                                      stderr, for initStorageManagerWithProfile
+ *   --csv=FILE                         Append the results to FILE as CSV
+ *   --trace=FILE                       Record the allocations of the sm runs to FILE, for the replay tool
+ *                                      in "Allocation Trace Replay". Every sm run overwrites it.
+ */
 
+#define MAX_ALLOCATION_VALUE 128 // each allocation can have max size of 128
+#define LATENCY_BUCKETS      (64 * 8)
+#define PRODCONS_QUEUE_SIZE  4096
+#define MAX_PROFILE_POOLS    256
 
-#define DO_POOL_ALLOCATION false
+const unsigned int POOL_SIZE = 0xffff;
+const unsigned int INITIAL_POOLS[] = { 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120, 128};
 
-#define DO_DEALLOCATIONS_ALWAYS false   // Priority 1 - If this is true, value of DO_DEALLOCATIONS is ignored
-#define DO_DEALLOCATIONS true           // Priority 2
+typedef enum { ALLOCATOR_SM, ALLOCATOR_MALLOC } Allocator_t;
+typedef enum { WORKLOAD_CHURN, WORKLOAD_PRODCONS, WORKLOAD_CHASE, WORKLOAD_STRESS } Workload_t;
+typedef enum { CHASE_CACHES, CHASE_CLASSES } ChasePools_t;
+typedef enum { SIZES_UNIFORM, SIZES_ZIPF, SIZES_POW2 } Sizes_t;
+typedef enum { FREE_LIFO, FREE_FIFO, FREE_RANDOM } FreeOrder_t;
 
-#define MAX_ALLOCATIONS 0xffffff // 2^24  allocations || 0xffffff = 16777215
-#define MAX_ALLOCATION_VALUE 128 // each allocation can have max size of 128
+typedef struct BenchConfig_tag
+{
+    Workload_t workload;
+    Sizes_t sizes;
+    FreeOrder_t freeOrder;
+    unsigned int minSize;
+    unsigned int maxSize;
+    unsigned long ops;
+    unsigned int live;
+    unsigned int sample;
+    unsigned int poolBlocks;
+    unsigned int alignment;
+    ChasePools_t chasePools;
+    unsigned int chasePoolCount;
+    unsigned int hotBlocks;
+    const char *tracePath;
+    bool isTuning;
+}BenchConfig_t;
 
-const unsigned int POOL_SIZE = 0xfffff; // poolsize = 1MB || 0xfffff = 1048575
-const unsigned int INITIAL_POOLS[] = { 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120, 128};
+/* Log-linear latency histogram: 8 buckets per power of two of nanoseconds */
+typedef struct Histogram_tag
+{
+    unsigned long long buckets[LATENCY_BUCKETS];
+    unsigned long long count;
+}Histogram_t;
 
-int main()
+typedef struct BenchResult_tag
 {
-    if (DO_POOL_ALLOCATION)
-    {
-        
-        printf("Allocation from POOL\n");
-        int numPools = sizeof(INITIAL_POOLS) / sizeof(INITIAL_POOLS[0]);
-        initStorageManager(POOL_SIZE, numPools, INITIAL_POOLS);
+    double seconds;
+    unsigned long long ops;
+    double allocPercentiles[3];
+    double freePercentiles[3];
+    long peakRssKb;
+    unsigned long long hotBlocks;
+}BenchResult_t;
+
+static const char *ALLOCATOR_NAMES[] = { "sm", "malloc" };
+static const char *WORKLOAD_NAMES[] = { "churn", "prodcons", "chase", "stress" };
+static const char *CHASE_NAMES[] = { "caches", "classes" };
+static const char *SIZES_NAMES[] = { "uniform", "zipf", "pow2" };
+static const char *FREE_ORDER_NAMES[] = { "lifo", "fifo", "random" };
+static const char *POLICY_NAMES[] = { "lifo", "lowest" };
+static const double PERCENTILES[] = { 0.50, 0.99, 0.999 };
+
+static inline unsigned long long nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-        //displayPoolInfo();
+static void histogramAdd(Histogram_t *histogram, unsigned long long ns)
+{
+    unsigned int bucket = 0;
+    if (ns >= 8)
+    {
+        unsigned int exponent = 63 - __builtin_clzll(ns);
+        bucket = (exponent - 2) * 8 + (unsigned int)((ns >> (exponent - 3)) & 7);
     }
     else
     {
-        printf("Allocation from HEAP\n");
+        bucket = (unsigned int)ns;
     }
+    histogram->buckets[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+    histogram->count++;
+}
 
-    unsigned int i = 0;
-    unsigned int sz = 0;
-    vector<unsigned int>  allocSize;
-    while (i < MAX_ALLOCATIONS)
+/* Returns the lower bound in ns of a histogram bucket */
+static double histogramBucketValue(unsigned int bucket)
+{
+    if (bucket < 8)
     {
-        do
-        {// rand()% (MAX_ALLOCATION_VALUE -8 + 1)
-            sz = 8 + rand()% (MAX_ALLOCATION_VALUE -8 + 1);
-            //sz = 8 + g_rndGenerator.generateRandom(MAX_ALLOCATION_VALUE -8 + 1);
-        } while (sz % 8 != 0);
+        return bucket;
+    }
+    unsigned int exponent = bucket / 8 + 2;
+    return (double)(1ULL << exponent) + (double)(bucket % 8) * (double)(1ULL << (exponent - 3));
+}
 
-        allocSize.push_back(sz);
-        i++;
+static double histogramPercentile(const Histogram_t *histogram, double percentile)
+{
+    unsigned long long target = (unsigned long long)ceil(percentile * histogram->count);
+    unsigned long long seen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target && histogram->buckets[i] > 0)
+        {
+            return histogramBucketValue(i);
+        }
     }
+    return 0;
+}
 
+static inline unsigned long long nextRandom(unsigned long long *state)
+{
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
 
-    DWORD count = GetTickCount();
-    unsigned int heapAllocs = 0;
-    unsigned int heapFrees = 0;
+/* Pre-generates the request sizes of one thread so that the timed loop does no RNG work */
+static vector<unsigned int> generateSizes(const BenchConfig_t *config, unsigned long long seed)
+{
+    vector<unsigned int> sizes(config->ops);
+    unsigned long long state = seed * 0x9E3779B97F4A7C15ULL + 1;
 
-    i = 0;
-    while (i < MAX_ALLOCATIONS)
+    if (config->sizes == SIZES_UNIFORM)
     {
-        if (DO_POOL_ALLOCATION)
+        for (unsigned long i = 0; i < config->ops; i++)
         {
-            char *ptr = SM_ALLOC_ARRAY(char, allocSize[i]);
-            if (ptr == nullptr)
+            sizes[i] = config->minSize + nextRandom(&state) % (config->maxSize - config->minSize + 1);
+        }
+    }
+    else if (config->sizes == SIZES_POW2)
+    {
+        vector<unsigned int> powers;
+        for (unsigned int size = 1; size <= config->maxSize && size != 0; size <<= 1)
+        {
+            if (size >= config->minSize)
             {
-                printf("ERROR: ALLOC FAILED!\n");
-                abort();
+                powers.push_back(size);
             }
+        }
+        if (powers.empty())
+        {
+            powers.push_back(config->maxSize);
+        }
+        for (unsigned long i = 0; i < config->ops; i++)
+        {
+            sizes[i] = powers[nextRandom(&state) % powers.size()];
+        }
+    }
+    else
+    {
+        /* Zipf with s = 1 over the sizes minSize, minSize + 8, ..., smallest sizes most popular */
+        vector<double> cdf;
+        double total = 0;
+        for (unsigned int size = config->minSize, rank = 1; size <= config->maxSize; size += 8, rank++)
+        {
+            total += 1.0 / rank;
+            cdf.push_back(total);
+        }
+        for (unsigned long i = 0; i < config->ops; i++)
+        {
+            double u = (double)(nextRandom(&state) >> 11) / (double)(1ULL << 53) * total;
+            size_t rank = lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+            sizes[i] = config->minSize + 8 * (unsigned int)(rank < cdf.size() ? rank : cdf.size() - 1);
+        }
+    }
+    return sizes;
+}
+
+static inline void *benchAlloc(Allocator_t allocator, size_t size)
+{
+    void *ptr = allocator == ALLOCATOR_SM ? SM_alloc(size) : malloc(size);
+    if (ptr == nullptr)
+    {
+        printf("ERROR: ALLOC FAILED!\n");
+        abort();
+    }
+    *(volatile char *)ptr = 1;
+    return ptr;
+}
+
+static inline void benchFree(Allocator_t allocator, void *ptr)
+{
+    if (allocator == ALLOCATOR_SM)
+    {
+        SM_dealloc(ptr);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
+
+/* One churn thread: keeps config->live blocks alive, freeing one in the configured order before
+ * every allocation once the working set is full. */
+static void churnThread(Allocator_t allocator, const BenchConfig_t *config, const vector<unsigned int> *sizes,
+                        Histogram_t *allocHistogram, Histogram_t *freeHistogram, unsigned long long seed)
+{
+    vector<void *> live(config->live);
+    unsigned int head = 0;          // FIFO: oldest live block
+    unsigned int count = 0;
+    unsigned long long state = seed + 7;
+
+    for (unsigned long i = 0; i < config->ops; i++)
+    {
+        bool timed = (i % config->sample) == 0;
 
-            if (DO_DEALLOCATIONS_ALWAYS)
+        if (count == config->live)
+        {
+            void *victim = nullptr;
+            if (config->freeOrder == FREE_LIFO)
             {
-                SM_DEALLOC(ptr);
+                victim = live[--count];
             }
-            else if (DO_DEALLOCATIONS && (rand()%10) < 5)
+            else if (config->freeOrder == FREE_FIFO)
             {
-                SM_DEALLOC(ptr);
+                victim = live[head];
+                head = (head + 1) % config->live;
+                count--;
             }
             else
             {
-                //DON'T DEALLOCATE 
+                unsigned int index = (unsigned int)(nextRandom(&state) % count);
+                victim = live[index];
+                live[index] = live[--count];
             }
+
+            unsigned long long start = timed ? nowNs() : 0;
+            benchFree(allocator, victim);
+            if (timed)
+            {
+                histogramAdd(freeHistogram, nowNs() - start);
+            }
+        }
+
+        unsigned long long start = timed ? nowNs() : 0;
+        void *ptr = benchAlloc(allocator, (*sizes)[i]);
+        if (timed)
+        {
+            histogramAdd(allocHistogram, nowNs() - start);
+        }
+
+        if (config->freeOrder == FREE_FIFO)
+        {
+            live[(head + count) % config->live] = ptr;
         }
         else
         {
-            char *ptr = (char *)malloc(allocSize[i]);
-            if (ptr)
-            {
-                heapAllocs++;
-            }
-            else
+            live[count] = ptr;
+        }
+        count++;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        benchFree(allocator, live[config->freeOrder == FREE_FIFO ? (head + i) % config->live : i]);
+    }
+}
+
+/* Single producer, single consumer ring of blocks handed from a producer to a consumer thread */
+typedef struct HandoffQueue_tag
+{
+    alignas(64) atomic<unsigned long> head;
+    alignas(64) atomic<unsigned long> tail;
+    void *slots[PRODCONS_QUEUE_SIZE];
+}HandoffQueue_t;
+
+static void producerThread(Allocator_t allocator, const BenchConfig_t *config, const vector<unsigned int> *sizes,
+                           Histogram_t *allocHistogram, HandoffQueue_t *queue)
+{
+    for (unsigned long i = 0; i < config->ops; i++)
+    {
+        bool timed = (i % config->sample) == 0;
+        unsigned long long start = timed ? nowNs() : 0;
+        void *ptr = benchAlloc(allocator, (*sizes)[i]);
+        if (timed)
+        {
+            histogramAdd(allocHistogram, nowNs() - start);
+        }
+
+        unsigned long tail = queue->tail.load(memory_order_relaxed);
+        while (tail - queue->head.load(memory_order_acquire) == PRODCONS_QUEUE_SIZE)
+        {
+            this_thread::yield();
+        }
+        queue->slots[tail % PRODCONS_QUEUE_SIZE] = ptr;
+        queue->tail.store(tail + 1, memory_order_release);
+    }
+}
+
+static void consumerThread(Allocator_t allocator, const BenchConfig_t *config, Histogram_t *freeHistogram,
+                           HandoffQueue_t *queue)
+{
+    for (unsigned long i = 0; i < config->ops; i++)
+    {
+        unsigned long head = queue->head.load(memory_order_relaxed);
+        while (queue->tail.load(memory_order_acquire) == head)
+        {
+            this_thread::yield();
+        }
+        void *ptr = queue->slots[head % PRODCONS_QUEUE_SIZE];
+        queue->head.store(head + 1, memory_order_release);
+
+        bool timed = (i % config->sample) == 0;
+        unsigned long long start = timed ? nowNs() : 0;
+        benchFree(allocator, ptr);
+        if (timed)
+        {
+            histogramAdd(freeHistogram, nowNs() - start);
+        }
+    }
+}
+
+/* Stress blocks hold their size in the first bytes and a byte derived from it in the rest */
+static inline void stressFill(void *ptr, unsigned int size)
+{
+    memset(ptr, (int)(size * 131 & 0xff), size);
+    memcpy(ptr, &size, sizeof(size));
+}
+
+static void stressCheck(const BenchConfig_t *config, void *ptr)
+{
+    unsigned int size = 0;
+    memcpy(&size, ptr, sizeof(size));
+    bool isValid = size >= config->minSize && size <= config->maxSize;
+    for (unsigned int i = sizeof(size); isValid && i < size; i++)
+    {
+        isValid = ((unsigned char *)ptr)[i] == (unsigned char)(size * 131 & 0xff);
+    }
+    if (!isValid)
+    {
+        printf("ERROR: STRESS BLOCK %p CORRUPTED!\n", ptr);
+        abort();
+    }
+}
+
+/* One stress thread: once all workers are ready, takes a first block of every size class, then stores
+ * every new block in a random slot of the shared array and frees the block it replaces, which another
+ * thread allocated most of the time. */
+static void stressThread(Allocator_t allocator, const BenchConfig_t *config, const vector<unsigned int> *sizes,
+                         Histogram_t *allocHistogram, Histogram_t *freeHistogram, atomic<void *> *slots,
+                         unsigned long slotCount, atomic<unsigned int> *ready, unsigned int workers,
+                         unsigned long long seed)
+{
+    unsigned long long state = seed + 7;
+
+    ready->fetch_add(1, memory_order_acq_rel);
+    while (ready->load(memory_order_acquire) < workers)
+    {
+        this_thread::yield();
+    }
+    for (size_t size = config->minSize; size <= config->maxSize; size = SM_sizeClassSize(size + 1))
+    {
+        void *ptr = benchAlloc(allocator, size);
+        stressFill(ptr, (unsigned int)size);
+        stressCheck(config, ptr);
+        benchFree(allocator, ptr);
+    }
+
+    for (unsigned long i = 0; i < config->ops; i++)
+    {
+        bool timed = (i % config->sample) == 0;
+
+        unsigned long long start = timed ? nowNs() : 0;
+        void *ptr = benchAlloc(allocator, (*sizes)[i]);
+        if (timed)
+        {
+            histogramAdd(allocHistogram, nowNs() - start);
+        }
+        stressFill(ptr, (*sizes)[i]);
+
+        void *victim = slots[nextRandom(&state) % slotCount].exchange(ptr, memory_order_acq_rel);
+        if (victim != nullptr)
+        {
+            stressCheck(config, victim);
+            start = timed ? nowNs() : 0;
+            benchFree(allocator, victim);
+            if (timed)
             {
-                printf("\n\n**HEAP ALLOCATION FAILURE!**\n");
-                abort();
+                histogramAdd(freeHistogram, nowNs() - start);
             }
+        }
+    }
+}
+
+/* Links the first config->hotBlocks blocks of every chase pool in one random cycle and follows it for
+ * config->ops dependent loads. Blocks of different pools which map to the same cache sets evict each
+ * other, so the time per access shows how well the slab colors spread them. */
+static void chaseThread(Allocator_t allocator, const BenchConfig_t *config, BenchResult_t *result)
+{
+    vector<void *> hot;
+    vector<SM_ObjectCache_t *> caches;
+    vector<size_t> cacheOf;
 
-            if (DO_DEALLOCATIONS_ALWAYS)
+    if (config->chasePools == CHASE_CACHES)
+    {
+        for (unsigned int p = 0; p < config->chasePoolCount; p++)
+        {
+            SM_ObjectCache_t *cache = nullptr;
+            if (allocator == ALLOCATOR_SM)
             {
-                free(ptr);
-                ptr == nullptr;
-                heapFrees++;
+                char name[SM_OBJECT_CACHE_NAME_SIZE];
+                snprintf(name, sizeof(name), "chase%u", p);
+                cache = SM_cache_create(name, config->minSize, config->alignment, nullptr, nullptr);
+                if (cache == nullptr)
+                {
+                    printf("ERROR: CACHE CREATE FAILED!\n");
+                    abort();
+                }
+                caches.push_back(cache);
             }
-            else if (DO_DEALLOCATIONS && (rand()%10 )< 5)
+            for (unsigned int k = 0; k < config->hotBlocks; k++)
             {
-                free(ptr);
-                ptr == nullptr;
-                heapFrees++;
+                void *ptr = cache != nullptr ? SM_cache_alloc(cache) : benchAlloc(allocator, config->minSize);
+                if (ptr == nullptr)
+                {
+                    printf("ERROR: ALLOC FAILED!\n");
+                    abort();
+                }
+                hot.push_back(ptr);
+                cacheOf.push_back(p);
             }
-            else
+        }
+    }
+    else
+    {
+        for (size_t size = config->minSize; size <= config->maxSize; size = SM_sizeClassSize(size + 1))
+        {
+            for (unsigned int k = 0; k < config->hotBlocks; k++)
             {
-                //DON'T DEALLOCATE 
+                void *ptr = nullptr;
+                if (allocator == ALLOCATOR_SM)
+                {
+                    /* SM_alloc_batch bypasses the magazines and takes the first free blocks of the pool */
+                    if (SM_alloc_batch(size, 1, &ptr) != 1)
+                    {
+                        printf("ERROR: ALLOC FAILED!\n");
+                        abort();
+                    }
+                }
+                else
+                {
+                    ptr = benchAlloc(allocator, size);
+                }
+                hot.push_back(ptr);
             }
         }
-        i++;
     }
 
-    DWORD timetaken = GetTickCount() - count;
+    size_t count = hot.size();
+    vector<size_t> order(count);
+    unsigned long long state = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        order[i] = i;
+    }
+    for (size_t i = count - 1; i > 0; i--)
+    {
+        swap(order[i], order[nextRandom(&state) % (i + 1)]);
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        *(void **)hot[order[i]] = hot[order[(i + 1) % count]];
+    }
+
+    void *ptr = hot[order[0]];
+    unsigned long long start = nowNs();
+    for (unsigned long i = 0; i < config->ops; i++)
+    {
+        ptr = *(void **)ptr;
+    }
+    result->seconds = (nowNs() - start) / 1e9;
+    result->ops = config->ops;
+    result->hotBlocks = count;
+    void *volatile last = ptr;
+    (void)last;
 
-    if (DO_POOL_ALLOCATION)
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!caches.empty())
+        {
+            SM_cache_free(caches[cacheOf[i]], hot[i]);
+        }
+        else
+        {
+            benchFree(allocator, hot[i]);
+        }
+    }
+    for (size_t c = 0; c < caches.size(); c++)
     {
-        displayPoolInfo();
+        SM_cache_destroy(caches[c]);
+    }
+}
+
+/* Prints the pools recommended by this run on stderr, as the child's stdout is discarded */
+static void printPoolProfile(unsigned int threads)
+{
+    vector<SM_PoolProfile_t> profile(MAX_PROFILE_POOLS);
+    int count = SM_getPoolProfile(profile.data(), (int)profile.size(), 25);
+
+    fprintf(stderr, "Recommended pools for %u threads (peak + 25%%):\n", threads);
+    fprintf(stderr, "const SM_PoolProfile_t PROFILE[] = {");
+    for (int i = 0; i < count; i++)
+    {
+        fprintf(stderr, "%s{ %u, %u }", i % 6 == 0 ? "\n    " : " ", profile[i].poolSize, profile[i].initialBlocks);
+        if (i + 1 < count)
+        {
+            fprintf(stderr, ",");
+        }
+    }
+    fprintf(stderr, "\n};\n\n");
+}
+
+/* Runs the churn, stress or producer and consumer threads. threads is the total thread count; producer and
+ * consumer workloads use threads / 2 pairs, at least one. */
+static void runWorkers(Allocator_t allocator, const BenchConfig_t *config, unsigned int threads, BenchResult_t *result)
+{
+    unsigned int workers = config->workload == WORKLOAD_PRODCONS ? (threads < 2 ? 1 : threads / 2) : threads;
+    vector<vector<unsigned int> > sizes(workers);
+    for (unsigned int t = 0; t < workers; t++)
+    {
+        sizes[t] = generateSizes(config, t + 1);
+    }
+
+    vector<Histogram_t> allocHistograms(workers);
+    vector<Histogram_t> freeHistograms(workers);
+    memset(allocHistograms.data(), 0, workers * sizeof(Histogram_t));
+    memset(freeHistograms.data(), 0, workers * sizeof(Histogram_t));
+    vector<HandoffQueue_t *> queues;
+    vector<thread> pool;
+    unsigned long slotCount = (unsigned long)config->live * workers;
+    atomic<void *> *slots = config->workload == WORKLOAD_STRESS ? new atomic<void *>[slotCount]() : nullptr;
+    atomic<unsigned int> ready(0);
+
+    bool isTracing = allocator == ALLOCATOR_SM && config->tracePath != nullptr && SM_traceStart();
+    unsigned long long start = nowNs();
+    for (unsigned int t = 0; t < workers; t++)
+    {
+        if (config->workload == WORKLOAD_CHURN)
+        {
+            pool.emplace_back(churnThread, allocator, config, &sizes[t], &allocHistograms[t], &freeHistograms[t], t + 1);
+        }
+        else if (config->workload == WORKLOAD_STRESS)
+        {
+            pool.emplace_back(stressThread, allocator, config, &sizes[t], &allocHistograms[t], &freeHistograms[t],
+                              slots, slotCount, &ready, workers, t + 1);
+        }
+        else
+        {
+            HandoffQueue_t *queue = new HandoffQueue_t();
+            queues.push_back(queue);
+            pool.emplace_back(producerThread, allocator, config, &sizes[t], &allocHistograms[t], queue);
+            pool.emplace_back(consumerThread, allocator, config, &freeHistograms[t], queue);
+        }
+    }
+    for (size_t t = 0; t < pool.size(); t++)
+    {
+        pool[t].join();
+    }
+    result->seconds = (nowNs() - start) / 1e9;
+    result->ops = (unsigned long long)workers * config->ops;
+    if (isTracing)
+    {
+        SM_traceStop(config->tracePath);
+    }
+
+    Histogram_t allocHistogram;
+    Histogram_t freeHistogram;
+    memset(&allocHistogram, 0, sizeof(allocHistogram));
+    memset(&freeHistogram, 0, sizeof(freeHistogram));
+    for (unsigned int t = 0; t < workers; t++)
+    {
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            allocHistogram.buckets[i] += allocHistograms[t].buckets[i];
+            freeHistogram.buckets[i] += freeHistograms[t].buckets[i];
+        }
+        allocHistogram.count += allocHistograms[t].count;
+        freeHistogram.count += freeHistograms[t].count;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        result->allocPercentiles[i] = histogramPercentile(&allocHistogram, PERCENTILES[i]);
+        result->freePercentiles[i] = histogramPercentile(&freeHistogram, PERCENTILES[i]);
+    }
+
+    for (size_t q = 0; q < queues.size(); q++)
+    {
+        delete queues[q];
+    }
+    for (unsigned long i = 0; slots != nullptr && i < slotCount; i++)
+    {
+        void *ptr = slots[i].load(memory_order_relaxed);
+        if (ptr != nullptr)
+        {
+            stressCheck(config, ptr);
+            benchFree(allocator, ptr);
+        }
+    }
+    delete[] slots;
+}
+
+/* Runs one configuration in the calling process */
+static BenchResult_t runBenchmark(Allocator_t allocator, const BenchConfig_t *config, unsigned int threads)
+{
+    BenchResult_t result;
+    memset(&result, 0, sizeof(result));
+
+    if (allocator == ALLOCATOR_SM)
+    {
+        initStorageManager(config->poolBlocks, sizeof(INITIAL_POOLS) / sizeof(INITIAL_POOLS[0]), INITIAL_POOLS);
+        if (config->alignment != 0)
+        {
+            for (size_t size = config->minSize; size <= config->maxSize; size = SM_sizeClassSize(size + 1))
+            {
+                SM_setPoolAlignment(size, config->alignment);
+            }
+        }
+    }
+
+    if (config->workload == WORKLOAD_CHASE)
+    {
+        chaseThread(allocator, config, &result);
     }
     else
     {
-        printf("\n");
-        printf("heapAllocs  : %u\n", heapAllocs);
-        printf("heapFrees   : %u", heapFrees);
+        runWorkers(allocator, config, threads, &result);
     }
 
-    cout << "\n\n** Interval = " << timetaken << " ms ****" << endl;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result.peakRssKb = usage.ru_maxrss;
 
-    if (DO_POOL_ALLOCATION)
+    if (allocator == ALLOCATOR_SM)
     {
+        if (config->isTuning)
+        {
+            printPoolProfile(threads);
+        }
         destroyStorageManager();
     }
+    return result;
+}
+
+/* Runs one configuration in a child process so the peak RSS is not inherited from earlier runs */
+static bool runIsolated(Allocator_t allocator, const BenchConfig_t *config, unsigned int threads, BenchResult_t *result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        /* Keep the storage manager's own messages out of the result table */
+        if (freopen("/dev/null", "w", stdout) == nullptr)
+        {
+            _exit(1);
+        }
+        BenchResult_t childResult = runBenchmark(allocator, config, threads);
+        ssize_t written = write(fds[1], &childResult, sizeof(childResult));
+        _exit(written == (ssize_t)sizeof(childResult) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t bytes = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return pid > 0 && bytes == (ssize_t)sizeof(*result) && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int parseChoice(const char *value, const char **names, int count, const char *option)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(value, names[i]) == 0)
+        {
+            return i;
+        }
+    }
+    printf("Unknown value '%s' for %s\n", value, option);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig_t config = { WORKLOAD_CHURN, SIZES_UNIFORM, FREE_RANDOM, 8, MAX_ALLOCATION_VALUE, 1000000, 10000, 16, POOL_SIZE, 0, CHASE_CACHES, 32, 1, nullptr, false };
+    vector<Allocator_t> allocators = { ALLOCATOR_SM, ALLOCATOR_MALLOC };
+    vector<unsigned int> threadCounts = { 1 };
+    const char *csvPath = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = strchr(argv[i], '=');
+        string option = value ? string(argv[i], value - argv[i]) : string(argv[i]);
+        value = value ? value + 1 : "";
+
+        if (option == "--allocator")
+        {
+            allocators.clear();
+            if (strcmp(value, "both") == 0 || strcmp(value, "sm") == 0)
+            {
+                allocators.push_back(ALLOCATOR_SM);
+            }
+            if (strcmp(value, "both") == 0 || strcmp(value, "malloc") == 0)
+            {
+                allocators.push_back(ALLOCATOR_MALLOC);
+            }
+            if (allocators.empty())
+            {
+                parseChoice(value, ALLOCATOR_NAMES, 2, "--allocator");
+            }
+        }
+        else if (option == "--workload")
+        {
+            config.workload = (Workload_t)parseChoice(value, WORKLOAD_NAMES, 4, "--workload");
+        }
+        else if (option == "--chase")
+        {
+            config.chasePools = (ChasePools_t)parseChoice(value, CHASE_NAMES, 2, "--chase");
+        }
+        else if (option == "--chase-pools")
+        {
+            config.chasePoolCount = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--hot")
+        {
+            config.hotBlocks = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--sizes")
+        {
+            config.sizes = (Sizes_t)parseChoice(value, SIZES_NAMES, 3, "--sizes");
+        }
+        else if (option == "--free-order")
+        {
+            config.freeOrder = (FreeOrder_t)parseChoice(value, FREE_ORDER_NAMES, 3, "--free-order");
+        }
+        else if (option == "--min-size")
+        {
+            config.minSize = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--max-size")
+        {
+            config.maxSize = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--ops")
+        {
+            config.ops = strtoul(value, nullptr, 0);
+        }
+        else if (option == "--live")
+        {
+            config.live = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--sample")
+        {
+            config.sample = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--pool-blocks")
+        {
+            config.poolBlocks = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--policy")
+        {
+            SM_Config_t smConfig;
+            SM_getConfig(&smConfig);
+            smConfig.allocationPolicy = (SM_AllocationPolicy_t)parseChoice(value, POLICY_NAMES, 2, "--policy");
+            SM_configure(&smConfig);
+        }
+        else if (option == "--colors")
+        {
+            SM_Config_t smConfig;
+            SM_getConfig(&smConfig);
+            smConfig.colorCount = (unsigned int)strtoul(value, nullptr, 0);
+            SM_configure(&smConfig);
+        }
+        else if (option == "--align")
+        {
+            config.alignment = (unsigned int)strtoul(value, nullptr, 0);
+        }
+        else if (option == "--threads")
+        {
+            threadCounts.clear();
+            for (char *next = (char *)value; *next != '\0'; )
+            {
+                threadCounts.push_back((unsigned int)strtoul(next, &next, 10));
+                if (*next == ',')
+                {
+                    next++;
+                }
+            }
+        }
+        else if (option == "--csv")
+        {
+            csvPath = value;
+        }
+        else if (option == "--trace")
+        {
+            config.tracePath = value;
+        }
+        else if (option == "--tune")
+        {
+            config.isTuning = true;
+        }
+        else
+        {
+            printf("Usage: %s [--allocator=sm|malloc|both] [--workload=churn|prodcons|chase|stress]\n          [--sizes=uniform|zipf|pow2]\n"
+                   "          [--min-size=N] [--max-size=N] [--free-order=lifo|fifo|random] [--threads=N,N,...]\n"
+                   "          [--ops=N] [--live=N] [--sample=N] [--pool-blocks=N] [--csv=FILE]\n"
+                   "          [--policy=lifo|lowest] [--colors=N] [--align=N] [--trace=FILE] [--tune]\n"
+                   "          [--chase=caches|classes] [--chase-pools=N] [--hot=N]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.minSize == 0 || config.maxSize < config.minSize || config.live == 0 || config.sample == 0 || threadCounts.empty() ||
+        (config.workload == WORKLOAD_STRESS && config.minSize < sizeof(unsigned int)) ||
+        (config.workload == WORKLOAD_CHASE && (config.minSize < sizeof(void *) || config.hotBlocks == 0 || config.ops == 0 ||
+                                                (config.chasePools == CHASE_CACHES && config.chasePoolCount == 0))))
+    {
+        printf("ERROR: invalid configuration\n");
+        return 1;
+    }
+
+    FILE *csv = nullptr;
+    if (csvPath != nullptr)
+    {
+        csv = fopen(csvPath, "a");
+        if (csv == nullptr)
+        {
+            perror(csvPath);
+            return 1;
+        }
+        if (ftell(csv) == 0)
+        {
+            fprintf(csv, "allocator,workload,sizes,free_order,min_size,max_size,threads,ops,seconds,mops_per_sec,"
+                         "alloc_p50_ns,alloc_p99_ns,alloc_p999_ns,free_p50_ns,free_p99_ns,free_p999_ns,peak_rss_kb\n");
+        }
+    }
+
+    if (config.workload == WORKLOAD_CHASE)
+    {
+        SM_Config_t smConfig;
+        SM_getConfig(&smConfig);
+        printf("workload=chase pools=%s [%u, %u] hot=%u colors=%u align=%u accesses=%lu\n\n",
+               CHASE_NAMES[config.chasePools], config.minSize, config.maxSize, config.hotBlocks, smConfig.colorCount,
+               config.alignment, config.ops);
+        printf("%-8s %10s %10s %10s | %12s\n", "alloc", "hot blocks", "seconds", "ns/access", "peak RSS KB");
+    }
+    else
+    {
+        printf("workload=%s sizes=%s [%u, %u] free-order=%s ops/thread=%lu live=%u\n\n",
+               WORKLOAD_NAMES[config.workload], SIZES_NAMES[config.sizes], config.minSize, config.maxSize,
+               FREE_ORDER_NAMES[config.freeOrder], config.ops, config.live);
+        printf("%-8s %7s %10s %10s | %9s %9s %9s | %9s %9s %9s | %12s\n", "alloc", "threads", "seconds", "Mops/s",
+               "a.p50 ns", "a.p99 ns", "a.p999 ns", "f.p50 ns", "f.p99 ns", "f.p999 ns", "peak RSS KB");
+    }
+
+    for (size_t t = 0; t < threadCounts.size(); t++)
+    {
+        for (size_t a = 0; a < allocators.size(); a++)
+        {
+            BenchResult_t result;
+            if (!runIsolated(allocators[a], &config, threadCounts[t], &result))
+            {
+                printf("ERROR: %s run with %u threads failed\n", ALLOCATOR_NAMES[allocators[a]], threadCounts[t]);
+                continue;
+            }
+
+            double mops = result.ops / result.seconds / 1e6;
+            if (config.workload == WORKLOAD_CHASE)
+            {
+                printf("%-8s %10llu %10.3f %10.2f | %12ld\n", ALLOCATOR_NAMES[allocators[a]], result.hotBlocks,
+                       result.seconds, result.seconds * 1e9 / result.ops, result.peakRssKb);
+            }
+            else
+            {
+                printf("%-8s %7u %10.3f %10.2f | %9.0f %9.0f %9.0f | %9.0f %9.0f %9.0f | %12ld\n",
+                       ALLOCATOR_NAMES[allocators[a]], threadCounts[t], result.seconds, mops,
+                       result.allocPercentiles[0], result.allocPercentiles[1], result.allocPercentiles[2],
+                       result.freePercentiles[0], result.freePercentiles[1], result.freePercentiles[2], result.peakRssKb);
+            }
+            if (csv != nullptr)
+            {
+                fprintf(csv, "%s,%s,%s,%s,%u,%u,%u,%llu,%.6f,%.3f,%.0f,%.0f,%.0f,%.0f,%.0f,%.0f,%ld\n",
+                        ALLOCATOR_NAMES[allocators[a]], WORKLOAD_NAMES[config.workload], SIZES_NAMES[config.sizes],
+                        FREE_ORDER_NAMES[config.freeOrder], config.minSize, config.maxSize, threadCounts[t], result.ops,
+                        result.seconds, mops, result.allocPercentiles[0], result.allocPercentiles[1],
+                        result.allocPercentiles[2], result.freePercentiles[0], result.freePercentiles[1],
+                        result.freePercentiles[2], result.peakRssKb);
+            }
+        }
+    }
 
-    getchar(); 
+    if (csv != nullptr)
+    {
+        fclose(csv);
+    }
     return 0;
 }
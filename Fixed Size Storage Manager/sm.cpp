@@ -1,228 +1,3044 @@
 #include "sm.h"
+#include "sm_trace.h"
 #include<map>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <atomic>
+#include <new>
+#include <time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
 
-unsigned int m_initialPoolSize;              
+unsigned int m_initialPoolSize;
 //vector<int> m_PoolSizes;
-map<unsigned int, PoolData_t*> m_PoolMap;    // Mapping of size and pool
+map<unsigned int, PoolData_t*> m_PoolMap;    // Mapping of class size and pool. Used by the admin paths and for
+                                             // classes above SM_MAX_SMALL_SIZE.
+atomic<PoolData_t*> m_PoolTable[SM_SIZE_CLASS_COUNT];                             // Pool of each small size class
+atomic<atomic<Slab_t*>*> m_SlabDirectory[(size_t)1 << SM_DIRECTORY_ROOT_BITS];   // Slab owning each region. Leaves are
+                                                                                  // allocated on first use. Written under
+                                                                                  // m_DirectoryLock, read without it.
+pthread_mutex_t m_PoolMapLock = PTHREAD_MUTEX_INITIALIZER;                        // Protects m_PoolMap and pool creation
+pthread_mutex_t m_DirectoryLock = PTHREAD_MUTEX_INITIALIZER;                      // Protects updates of m_SlabDirectory
+pthread_key_t m_ThreadCacheKey;                                                   // Flushes a thread's cache on exit
+pthread_once_t m_ThreadCacheKeyOnce = PTHREAD_ONCE_INIT;
+thread_local ThreadCache_t t_ThreadCache;                                         // Magazines of the calling thread
+ThreadCache_t *m_ThreadCacheList;                                                 // Caches of the live threads
+pthread_mutex_t m_ThreadCacheListLock = PTHREAD_MUTEX_INITIALIZER;                // Protects m_ThreadCacheList and the
+unsigned long long m_RetiredAllocations[SM_SIZE_CLASS_COUNT];                     // counters of exited threads
+unsigned long long m_RetiredRequestedBytes[SM_SIZE_CLASS_COUNT];
+unsigned long long m_RetiredFrees[SM_SIZE_CLASS_COUNT];
+unsigned long long m_RetiredFailedAllocations[SM_SIZE_CLASS_COUNT];
+unsigned long long m_RetiredLatency[SM_SIZE_CLASS_COUNT][SM_LATENCY_BUCKETS];
+SM_ObjectCache_t *m_ObjectCacheList;                                              // Object caches. Protected by m_PoolMapLock.
+unsigned int m_NextPoolColor;                                                     // Color of the first slab of the next pool.
+                                                                                  // Protected by m_PoolMapLock.
+atomic<unsigned int> m_LatencySampleInterval;                                     // Time every Nth SM_alloc. 0 disables.
+SM_Region_t *m_RegionList;                                                        // Regions. Protected by m_PoolMapLock.
+atomic<unsigned long long> m_LastDecaySweep;                                      // Time in milliseconds of the last sweep of
+                                                                                  // idle slabs by the allocation slow path
+thread_local SM_Region_t *t_Region;                                               // Region serving SM_alloc of the calling
+                                                                                  // thread, or nullptr
+
+/* Size class index of every request size up to SM_MAX_SMALL_SIZE, in steps of SM_SIZE_CLASS_QUANTUM,
+ * and size of every small class. Both are computed at compile time. */
+struct SizeClassTables
+{
+    unsigned char index[(SM_MAX_SMALL_SIZE >> SM_SIZE_CLASS_QUANTUM_SHIFT) + 1];
+    unsigned int size[SM_SIZE_CLASS_COUNT];
+
+    constexpr SizeClassTables() : index(), size()
+    {
+        for (size_t i = 0; i < sizeof(index); i++)
+        {
+            index[i] = (unsigned char)SM_sizeClassIndex(i << SM_SIZE_CLASS_QUANTUM_SHIFT);
+        }
+        for (size_t i = 0; i < sizeof(index); i++)
+        {
+            size[index[i]] = (unsigned int)SM_sizeClassSize(i << SM_SIZE_CLASS_QUANTUM_SHIFT);
+        }
+    }
+};
+static_assert(SM_SIZE_CLASS_COUNT <= 256, "Too many small size classes for the class index table");
+constexpr SizeClassTables m_SizeClasses;
+
+SM_Config_t m_Config = {
+    2,              // growthFactor
+    0x1000000,      // maxSlabBlocks
+    0,              // maxPoolSize
+    25,             // shrinkWatermark
+    SM_BACKING_MMAP,// backing
+    true,           // useHugePages
+    10000,          // decayTime
+    false,          // useMadvFree
+    64,             // colorCount
+    SM_POLICY_LIFO  // allocationPolicy
+};
+
+void SM_configure(const SM_Config_t *config)
+{
+    m_Config = *config;
+    if (m_Config.growthFactor == 0)
+    {
+        m_Config.growthFactor = 1;
+    }
+    if (m_Config.maxSlabBlocks == 0)
+    {
+        m_Config.maxSlabBlocks = 1;
+    }
+    if (m_Config.colorCount == 0)
+    {
+        m_Config.colorCount = 1;
+    }
+}
+
+void SM_getConfig(SM_Config_t *config)
+{
+    *config = m_Config;
+}
 
 void initStorageManager(const unsigned initialPoolSize, int numPools, const unsigned int *pools)
 {
     m_initialPoolSize = initialPoolSize;
-    unsigned int totalClaimedMemory = 0;
+    size_t totalClaimedMemory = 0;
 
     printf("StorageManager:: Initial Pools- ");
+    pthread_mutex_lock(&m_PoolMapLock);
     for (int i = 0; i < numPools; i++)
     {
-        PoolData_t *poolData = (PoolData_t *)malloc(sizeof(PoolData_t));
-        if (poolData == nullptr)
+        /* Sizes are rounded up to their class. Sizes sharing a class share one pool. */
+        unsigned int classSize = (unsigned int)SM_sizeClassSize(pools[i]);
+        if (m_PoolMap.find(classSize) == m_PoolMap.end())
         {
-            printf("\n\n**MEMORY ERROR: initStorageManager: Failed to create pool %u!!\n\n", pools[i]);
-            abort();
+            PoolData_t *poolData = createNewPool(classSize);
+            totalClaimedMemory += poolData->totalSize;
         }
 
-        memset(poolData, 0, sizeof(poolData));
+        printf("%d ", pools[i]);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
 
-        size_t sizeOfPoolInBytes = pools[i] * sizeof(char) * initialPoolSize;
-        totalClaimedMemory += sizeOfPoolInBytes;
-        char *ptr = (char *)malloc(sizeOfPoolInBytes);
+    printf("\nStorageManager:: Pool init complete\n");
+    printf("Total claimed memory: %zu MB\n\n", totalClaimedMemory/1000/1000);
 
-        initializePoolData(sizeOfPoolInBytes, ptr, pools[i], poolData);
+}
 
-        printf("%d ", pools[i]);
+/* Allocates an empty pool structure with its lock initialized, or returns nullptr */
+static PoolData_t *allocPoolData()
+{
+    PoolData_t *poolData = nullptr;
+    if (posix_memalign((void **)&poolData, SM_CACHE_LINE_SIZE, sizeof(PoolData_t)) != 0)
+    {
+        return nullptr;
     }
 
-    
-    printf("\nStorageManager:: Pool init complete\n");
-    printf("Total claimed memory: %u MB\n\n", totalClaimedMemory/1000/1000);
+    new (poolData) PoolData_t();
+    pthread_mutex_init(&poolData->lock, nullptr);
+    poolData->remoteFreeList.store(nullptr, memory_order_relaxed);
+    return poolData;
+}
 
+static void freePoolData(PoolData_t *poolData)
+{
+    pthread_mutex_destroy(&poolData->lock);
+    poolData->~PoolData_t();
+    free(poolData);
 }
 
-void createNewPool(unsigned sizeId)
+/* Creates the pool of the size class sizeId with a first slab of initialBlocks blocks. The caller holds
+ * m_PoolMapLock. */
+static PoolData_t *createPool(unsigned int sizeId, unsigned int initialBlocks)
 {
-    PoolData_t *poolData = (PoolData_t *)malloc(sizeof(PoolData_t));
+    PoolData_t *poolData = allocPoolData();
     if (poolData == nullptr)
     {
         printf("\n\n**MEMORY ERROR: createNewPool: Failed to create pool %u!!\n\n", sizeId);
         abort();
     }
 
-    memset(poolData, 0, sizeof(poolData));
+    /* Other threads find the pool in m_PoolTable without m_PoolMapLock as soon as it is published, and
+     * may expand it under its lock before the first slab is in place */
+    pthread_mutex_lock(&poolData->lock);
+    initializePoolData(sizeId, poolData);
+    poolData->nextSlabBlocks = initialBlocks > 0 ? initialBlocks : 1;
+    Slab_t *slab = expandPool(poolData);
+    pthread_mutex_unlock(&poolData->lock);
+    if (slab == nullptr)
+    {
+        printf("\n\n**MEMORY ERROR: createNewPool: Failed to create pool %u!!\n\n", sizeId);
+        abort();
+    }
+
+    return poolData;
+}
+
+/* Creates the pool of the size class sizeId. The caller holds m_PoolMapLock. */
+PoolData_t *createNewPool(unsigned sizeId)
+{
+    return createPool(sizeId, m_initialPoolSize);
+}
+
+/**
+ * The function `initStorageManagerWithProfile` initializes the storage manager like
+ * initStorageManager, but gives every pool of `profile` a first slab of its own number of blocks.
+ * Profiles are recommended by SM_getPoolProfile and printed by displayPoolProfile.
+ *
+ * @param poolSize Initial blocks of the pools which are not in the profile and are created on demand.
+ * @param numPools Number of entries in `profile`.
+ * @param profile Class size and initial blocks of every pool to create.
+ */
+void initStorageManagerWithProfile(const unsigned int poolSize, int numPools, const SM_PoolProfile_t *profile)
+{
+    m_initialPoolSize = poolSize;
+    size_t totalClaimedMemory = 0;
+
+    printf("StorageManager:: Initial Pools- ");
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (int i = 0; i < numPools; i++)
+    {
+        unsigned int classSize = (unsigned int)SM_sizeClassSize(profile[i].poolSize);
+        if (m_PoolMap.find(classSize) == m_PoolMap.end())
+        {
+            PoolData_t *poolData = createPool(classSize, profile[i].initialBlocks);
+            totalClaimedMemory += poolData->totalSize;
+        }
+
+        printf("%u:%u ", profile[i].poolSize, profile[i].initialBlocks);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
 
-    size_t sizeOfPoolInBytes = sizeId * sizeof(char) * m_initialPoolSize;
-    char *ptr = (char *)malloc(sizeOfPoolInBytes);
+    printf("\nStorageManager:: Pool init complete\n");
+    printf("Total claimed memory: %zu MB\n\n", totalClaimedMemory/1000/1000);
+}
 
-    initializePoolData(sizeOfPoolInBytes, ptr, sizeId, poolData);
-    printf("Created new pool : %u\n", sizeId);
+/* Slabs start on a region boundary, so blocks are aligned to the largest power of two dividing their
+ * size, up to SM_REGION_SIZE */
+static unsigned int naturalAlignment(unsigned int blockSize)
+{
+    unsigned int alignment = blockSize & (0 - blockSize);
+    return alignment < SM_REGION_SIZE ? alignment : SM_REGION_SIZE;
 }
 
-void initializePoolData(size_t sizeOfPoolInBytes, char *ptr, unsigned int sizeId, PoolData_t *poolData)
+/* Sets up the counters of a pool of blocks of sizeId bytes without registering it */
+static void resetPoolData(unsigned int sizeId, PoolData_t *poolData)
 {
     poolData->poolSize = sizeId;
-    poolData->startAddress = ptr;
-    poolData->endAddress = ptr + sizeOfPoolInBytes;
-    poolData->totalSize = sizeOfPoolInBytes;
-    poolData->remainingSpace = sizeOfPoolInBytes;
-    poolData->totalBlocks = (poolData->endAddress - poolData->startAddress) / poolData->poolSize;
-    poolData->freeBlocks = poolData->totalBlocks;
+    poolData->blockSize = sizeId < sizeof(FreeBlock_t) ? sizeof(FreeBlock_t) : sizeId;
+    poolData->alignment = naturalAlignment(poolData->blockSize);
+    /* Pools start at different colors so their first slabs do not share cache sets either */
+    poolData->nextColor = m_NextPoolColor++;
+    poolData->totalSize = 0;
+    poolData->remainingSpace = 0;
+    poolData->totalBlocks = 0;
+    poolData->freeBlocks = 0;
     poolData->usedBlocks = 0;
-    poolData->nextFreeBlock = -1;
-    poolData->nextFreeBlockInSequence = 0;
-    poolData->isFreedBlockBlockAvailable = false;
+    poolData->slabCount = 0;
+    poolData->nextSlabBlocks = m_initialPoolSize > 0 ? m_initialPoolSize : 1;
+    poolData->partialSlabs = nullptr;
+    poolData->emptySlabs = nullptr;
+    poolData->fullSlabs = nullptr;
     poolData->totalAllocationsFromThisPool = 0;
+    poolData->requestedBytes = 0;
+    poolData->highWaterBlocks = 0;
+    poolData->recentHighWaterBlocks = 0;
+    poolData->failedAllocations = 0;
+    poolData->cacheIndex = -1;
+    poolData->linkOffset = 0;
+    poolData->constructor = nullptr;
+    poolData->destructor = nullptr;
+    poolData->region = nullptr;
+    poolData->isAddressOrdered = m_Config.allocationPolicy == SM_POLICY_LOWEST_ADDRESS;
+}
+
+void initializePoolData(unsigned int sizeId, PoolData_t *poolData)
+{
+    resetPoolData(sizeId, poolData);
 
     m_PoolMap[sizeId] = poolData;
+    if (sizeId <= SM_MAX_SMALL_SIZE)
+    {
+        poolData->cacheIndex = SM_sizeClassIndex(sizeId);
+        m_PoolTable[poolData->cacheIndex].store(poolData, memory_order_release);
+    }
 }
 
-void expandPool(unsigned size)
+/**
+ * The function `findPoolFromSize` returns the pool of the size class serving requests of `size` bytes.
+ *
+ * @param size Requested size in bytes.
+ *
+ * @return The pool, or nullptr if no pool of this class exists yet.
+ */
+PoolData_t *findPoolFromSize(size_t size)
 {
-    //TODO
+    if (size <= SM_MAX_SMALL_SIZE)
+    {
+        return m_PoolTable[m_SizeClasses.index[(size + SM_SIZE_CLASS_QUANTUM - 1) >> SM_SIZE_CLASS_QUANTUM_SHIFT]].load(memory_order_acquire);
+    }
+
+    PoolData_t *poolData = nullptr;
+    pthread_mutex_lock(&m_PoolMapLock);
+    map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.find(SM_sizeClassSize(size));
+    if (it != m_PoolMap.end())
+    {
+        poolData = it->second;
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+    return poolData;
 }
 
-void displayPoolInfo()
+/* Returns the pool serving requests of size bytes, creating it if it is not present */
+static PoolData_t *findOrCreatePool(size_t size)
 {
-    map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin();
-    
-    printf("\n\n");
-    while (it != m_PoolMap.end())
+    PoolData_t *poolData = findPoolFromSize(size);
+    if (poolData != nullptr)
     {
-        PoolData_t *poolData = it->second;
-        unsigned int poolSize = it->first;
-
-        
-        printf("Pool %u\n", poolSize);
-        
-        printf("  totalAllocationsFromThisPool       : %u\n", poolData->totalAllocationsFromThisPool);
-        printf("  startAddress                       : 0x%x\n", poolData->startAddress);
-        printf("  endAddress                         : 0x%x\n", poolData->endAddress);
-        printf("  totalSize                          : %u bytes\n", poolData->totalSize);
-        printf("  remainingSpace                     : %u bytes\n", poolData->remainingSpace);
-        printf("  totalBlocks                        : %u\n", poolData->totalBlocks);
-        printf("  freeBlocks                         : %u\n", poolData->freeBlocks);
-        printf("  usedBlocks                         : %u\n", poolData->usedBlocks);
-        printf("\n");
+        return poolData;
+    }
 
-        it++;
+    unsigned int classSize = (unsigned int)SM_sizeClassSize(size);
+    pthread_mutex_lock(&m_PoolMapLock);
+    map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.find(classSize);
+    if (it != m_PoolMap.end())
+    {
+        poolData = it->second;
+    }
+    else
+    {
+        poolData = createNewPool(classSize);
     }
-    printf("\n** Total Pools: %d **\n", m_PoolMap.size());
+    pthread_mutex_unlock(&m_PoolMapLock);
+    return poolData;
 }
 
-void destroyStorageManager()
+/* Free lists link blocks through a FreeBlock_t at linkOffset in each block. It is 0 except for object
+ * caches, whose link lies after the object so a free object keeps its constructed state. */
+static inline FreeBlock_t *linkOfBlock(PoolData_t *poolData, void *block)
 {
-    //TODO
+    return (FreeBlock_t *)((char *)block + poolData->linkOffset);
 }
 
-/**
- * The function `SM_alloc` allocates memory from a pool based on the requested size, either reusing
- * freed blocks or allocating new blocks.
- * 
- * @param size The `size` parameter in the `SM_alloc` function represents the size of memory to be
- * allocated in bytes. This function is responsible for allocating memory from a memory pool based on
- * the specified size. If a pool of the required size is not present, it creates a new pool. The
- * function then
- * 
- * @return The function `SM_alloc` is returning a pointer of type `void` which points to the allocated
- * memory block.
- */
-void * SM_alloc(size_t size)
+static inline char *blockOfLink(PoolData_t *poolData, FreeBlock_t *link)
 {
-    //printf("SM_alloc called for %d bytes\n", size);
+    return (char *)link - poolData->linkOffset;
+}
 
-    /* Find which pool to use. If pool of required size not present, create a pool */
-    PoolData_t *poolData = m_PoolMap[size];
-    if (poolData != nullptr)
+/* Runs the constructor of an object cache on every block of a slab being populated */
+static void constructObjects(Slab_t *slab)
+{
+    if (slab->pool->constructor == nullptr)
     {
-        /* Check if this pool has enough free blocks */
-        if (poolData->freeBlocks == 0)
-        {
-            printf("ERROR: Pool %u exhausted!\n", size);
-            abort();
-            //expandPool(size);
-        }
+        return;
     }
-    else
+    for (unsigned int i = 0; i < slab->totalBlocks; i++)
     {
-        createNewPool(size);
-        poolData = m_PoolMap[size];
+        slab->pool->constructor(findAddressFromBlock(i, slab));
     }
+}
 
-    char *ptr = nullptr;
+/* Runs the destructor of an object cache on every block of a slab whose memory is going away */
+static void destructObjects(Slab_t *slab)
+{
+    if (slab->pool->destructor == nullptr || slab->isPurged)
+    {
+        return;
+    }
+    for (unsigned int i = 0; i < slab->totalBlocks; i++)
+    {
+        slab->pool->destructor(findAddressFromBlock(i, slab));
+    }
+}
+
+static void pushSlab(Slab_t **list, Slab_t *slab)
+{
+    slab->prev = nullptr;
+    slab->next = *list;
+    if (*list != nullptr)
+    {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
 
-    if (poolData->isFreedBlockBlockAvailable && poolData->nextFreeBlock >= 0)
+static void unlinkSlab(Slab_t **list, Slab_t *slab)
+{
+    if (slab->prev != nullptr)
     {
-        /* Allocating a block which was freed earlier. */
-        ptr = findAddressFromBlock(poolData->nextFreeBlock, poolData);
-        poolData->isFreedBlockBlockAvailable = false;
-        poolData->nextFreeBlock = -1;
-        //printf(">> From freed block, poolData->nextFreeBlock = %u\n", poolData->nextFreeBlock);
+        slab->prev->next = slab->next;
     }
     else
     {
-        /* Allocating from free blocks in sequnce */
-        ptr = findAddressFromBlock(poolData->nextFreeBlockInSequence, poolData);
-        //printf(">> From sequence\n");
-        poolData->nextFreeBlockInSequence++;
+        *list = slab->next;
+    }
+    if (slab->next != nullptr)
+    {
+        slab->next->prev = slab->prev;
     }
+    slab->next = nullptr;
+    slab->prev = nullptr;
+}
 
-    //printf("Allocated 0x%x (block %u) in pool %u\n", ptr, poolData->usedBlocks, poolData->poolSize);
+/* Puts a slab on one of the lists of its pool. Pools with isAddressOrdered keep their partial and
+ * empty lists sorted by address, so allocation goes to the lowest slab. */
+static void linkSlab(PoolData_t *poolData, Slab_t **list, Slab_t *slab)
+{
+    if (!poolData->isAddressOrdered || list == &poolData->fullSlabs)
+    {
+        pushSlab(list, slab);
+        return;
+    }
 
-    
-    poolData->freeBlocks--;
-    poolData->usedBlocks++;
-    poolData->remainingSpace -= size;
-    poolData->totalAllocationsFromThisPool++;
+    Slab_t *prev = nullptr;
+    Slab_t *next = *list;
+    while (next != nullptr && next->baseAddress < slab->baseAddress)
+    {
+        prev = next;
+        next = next->next;
+    }
+    slab->prev = prev;
+    slab->next = next;
+    if (next != nullptr)
+    {
+        next->prev = slab;
+    }
+    if (prev != nullptr)
+    {
+        prev->next = slab;
+    }
+    else
+    {
+        *list = slab;
+    }
+}
 
-    return ptr;
+static inline unsigned int bitmapWords(unsigned int blocks)
+{
+    return (blocks + 63) / 64;
 }
 
-void SM_dealloc(void *ptr)
+/* Allocates the Slab_t of a slab of blocks blocks of poolData, followed by its bitmap if the pool is
+ * address ordered. Released with free. */
+static Slab_t *allocSlabData(PoolData_t *poolData, unsigned int blocks)
 {
-    if (ptr == nullptr)
+    size_t words = poolData->isAddressOrdered ? bitmapWords(blocks) : 0;
+    Slab_t *slab = (Slab_t *)malloc(sizeof(Slab_t) + words * sizeof(uint64_t));
+    if (slab != nullptr)
+    {
+        slab->bitmap = words > 0 ? (uint64_t *)(slab + 1) : nullptr;
+        slab->firstFreeWord = 0;
+    }
+    return slab;
+}
+
+/* Marks every block of a slab with a bitmap as free */
+static void fillSlabBitmap(Slab_t *slab)
+{
+    if (slab->bitmap == nullptr)
     {
         return;
     }
+    unsigned int words = bitmapWords(slab->totalBlocks);
+    for (unsigned int i = 0; i < words; i++)
+    {
+        slab->bitmap[i] = ~(uint64_t)0;
+    }
+    if (slab->totalBlocks % 64 != 0)
+    {
+        slab->bitmap[words - 1] = ((uint64_t)1 << (slab->totalBlocks % 64)) - 1;
+    }
+    slab->firstFreeWord = 0;
+}
 
-    /* Find the pool in which this address lies. */
-    unsigned int poolSize = findPoolFromAddress(ptr);
-    //printf("Deallocating 0x%x from pool %u\n", ptr, poolSize);
+/* Takes the lowest free block of a slab with a bitmap and at least one free block. Full words are
+ * skipped 64 blocks at a time from firstFreeWord and the block is found with one count of trailing
+ * zeroes. */
+static inline unsigned int takeLowestBlock(Slab_t *slab)
+{
+    unsigned int word = slab->firstFreeWord;
+    while (slab->bitmap[word] == 0)
+    {
+        word++;
+    }
+    unsigned int block = word * 64 + __builtin_ctzll(slab->bitmap[word]);
+    slab->bitmap[word] &= slab->bitmap[word] - 1;
+    slab->firstFreeWord = word;
+    if (block >= slab->nextFreeBlockInSequence)
+    {
+        slab->nextFreeBlockInSequence = block + 1;
+    }
+    return block;
+}
 
-    /* Mark this address as free */
-    PoolData_t *poolData = m_PoolMap[poolSize];
-    poolData->freeBlocks++;
-    poolData->usedBlocks--;
-    poolData->nextFreeBlock = findBlockFromAddress((char *)ptr, poolData);
-    //printf("Setting nextFreeBlock=%u in pool %u\n", poolData->nextFreeBlock, poolData->poolSize);
-    poolData->isFreedBlockBlockAvailable = true;
-    poolData->remainingSpace += poolSize;
+/* Marks a block of a slab with a bitmap as free */
+static inline void putBlock(Slab_t *slab, void *ptr)
+{
+    unsigned int block = findBlockFromAddress((char *)ptr, slab);
+    slab->bitmap[block / 64] |= (uint64_t)1 << (block % 64);
+    if (block / 64 < slab->firstFreeWord)
+    {
+        slab->firstFreeWord = block / 64;
+    }
+}
 
-    //printf("Deallocated 0x%x block (%u) from pool %u\n", ptr, poolData->nextFreeBlock, poolSize);
+/* Returns the list of poolData a slab with usedBlocks used blocks belongs to */
+static Slab_t **slabListFor(PoolData_t *poolData, Slab_t *slab, unsigned int usedBlocks)
+{
+    if (usedBlocks == 0)
+    {
+        return &poolData->emptySlabs;
+    }
+    if (usedBlocks == slab->totalBlocks)
+    {
+        return &poolData->fullSlabs;
+    }
+    return &poolData->partialSlabs;
 }
 
-unsigned int findPoolFromAddress(void *ptr)
+/* Points every region of [ptr, ptr + size) to slab in the slab directory */
+static bool registerSlab(char *ptr, size_t size, Slab_t *slab)
 {
-    map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin();
-    while (it != m_PoolMap.end())
+    bool registered = true;
+    pthread_mutex_lock(&m_DirectoryLock);
+    for (uintptr_t region = (uintptr_t)ptr >> SM_REGION_SHIFT; region < ((uintptr_t)ptr + size) >> SM_REGION_SHIFT; region++)
     {
-        PoolData_t *poolData = it->second;
-        //printf(" Checking 0x%x in pool %u [0x%x, 0x%x] \n", ptr, poolData->poolSize, poolData->startAddress, poolData->endAddress);
-        if (ptr >= poolData->startAddress && ptr <= poolData->endAddress)
+        uintptr_t root = region >> SM_DIRECTORY_LEAF_BITS;
+        if (root >= ((uintptr_t)1 << SM_DIRECTORY_ROOT_BITS))
+        {
+            printf("\n\n**ERROR: %p is beyond the %d bit address space of the slab directory!!\n\n", ptr, SM_ADDRESS_BITS);
+            registered = false;
+            break;
+        }
+        atomic<Slab_t*> *leaf = m_SlabDirectory[root].load(memory_order_relaxed);
+        if (leaf == nullptr)
+        {
+            leaf = new (nothrow) atomic<Slab_t*>[(size_t)1 << SM_DIRECTORY_LEAF_BITS]();
+            if (leaf == nullptr)
+            {
+                registered = false;
+                break;
+            }
+            /* Released so that SM_dealloc on another thread sees the leaf initialized */
+            m_SlabDirectory[root].store(leaf, memory_order_release);
+        }
+        /* Released so that a block handed to another thread resolves to a fully set up slab */
+        leaf[region & (((uintptr_t)1 << SM_DIRECTORY_LEAF_BITS) - 1)].store(slab, memory_order_release);
+    }
+    pthread_mutex_unlock(&m_DirectoryLock);
+    return registered;
+}
+
+static void unregisterSlab(char *ptr, size_t size)
+{
+    pthread_mutex_lock(&m_DirectoryLock);
+    for (uintptr_t region = (uintptr_t)ptr >> SM_REGION_SHIFT; region < ((uintptr_t)ptr + size) >> SM_REGION_SHIFT; region++)
+    {
+        uintptr_t root = region >> SM_DIRECTORY_LEAF_BITS;
+        atomic<Slab_t*> *leaf = root < ((uintptr_t)1 << SM_DIRECTORY_ROOT_BITS) ?
+                                m_SlabDirectory[root].load(memory_order_relaxed) : nullptr;
+        if (leaf != nullptr)
+        {
+            leaf[region & (((uintptr_t)1 << SM_DIRECTORY_LEAF_BITS) - 1)].store(nullptr, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&m_DirectoryLock);
+}
+
+static unsigned long long nowMilliseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (unsigned long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Maps size bytes aligned to alignment. The unaligned head and tail of the mapping are unmapped. */
+static void *mapSlabMemory(size_t size, size_t alignment)
+{
+    char *ptr = (char *)mmap(nullptr, size + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    char *alignedPtr = (char *)(((uintptr_t)ptr + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (alignedPtr != ptr)
+    {
+        munmap(ptr, alignedPtr - ptr);
+    }
+    munmap(alignedPtr + size, ptr + alignment - alignedPtr);
+
+    if (m_Config.useHugePages && size >= SM_HUGE_PAGE_SIZE)
+    {
+        madvise(alignedPtr, size, MADV_HUGEPAGE);
+    }
+    return alignedPtr;
+}
+
+static void *allocSlabMemory(size_t size)
+{
+    void *ptr = nullptr;
+    if (m_Config.backing == SM_BACKING_MMAP)
+    {
+        bool isHuge = m_Config.useHugePages && size >= SM_HUGE_PAGE_SIZE;
+        return mapSlabMemory(size, isHuge ? SM_HUGE_PAGE_SIZE : SM_REGION_SIZE);
+    }
+    if (posix_memalign(&ptr, SM_REGION_SIZE, size) != 0)
+    {
+        return nullptr;
+    }
+    return ptr;
+}
+
+static void freeSlabMemory(void *ptr, size_t size)
+{
+    if (m_Config.backing == SM_BACKING_MMAP)
+    {
+        munmap(ptr, size);
+    }
+    else
+    {
+        free(ptr);
+    }
+}
+
+/**
+ * The function `expandPool` chains a new slab to a pool. The slab size grows geometrically by
+ * `growthFactor` from `m_initialPoolSize` blocks up to `maxSlabBlocks` blocks. The caller holds the
+ * pool lock.
+ *
+ * @param poolData The pool to expand.
+ *
+ * @return The new slab, or nullptr if the pool reached `maxPoolSize` or the OS is out of memory.
+ */
+Slab_t *expandPool(PoolData_t *poolData)
+{
+    unsigned int blocks = poolData->nextSlabBlocks;
+    size_t sizeOfSlabInBytes = (size_t)blocks * poolData->blockSize;
+
+    if (m_Config.maxPoolSize != 0 && poolData->totalSize + sizeOfSlabInBytes > m_Config.maxPoolSize)
+    {
+        /* Use whatever is left below the cap */
+        blocks = (unsigned int)((m_Config.maxPoolSize - poolData->totalSize) / poolData->blockSize);
+        if (blocks == 0)
+        {
+            printf("ERROR: Pool %u reached its limit of %zu bytes!\n", poolData->poolSize, m_Config.maxPoolSize);
+            return nullptr;
+        }
+        sizeOfSlabInBytes = (size_t)blocks * poolData->blockSize;
+    }
+
+    /* Round the slab up to whole regions, or whole huge pages for huge page backed slabs. The extra
+     * bytes become extra blocks. */
+    size_t slabSize = (sizeOfSlabInBytes + SM_REGION_SIZE - 1) & ~(SM_REGION_SIZE - 1);
+    if (m_Config.backing == SM_BACKING_MMAP && m_Config.useHugePages && slabSize >= SM_HUGE_PAGE_SIZE)
+    {
+        slabSize = (slabSize + SM_HUGE_PAGE_SIZE - 1) & ~(SM_HUGE_PAGE_SIZE - 1);
+    }
+    if (m_Config.maxPoolSize != 0 && poolData->totalSize + slabSize > m_Config.maxPoolSize)
+    {
+        slabSize -= SM_REGION_SIZE;
+        if (slabSize < poolData->blockSize)
         {
-            return poolData->poolSize;
+            printf("ERROR: Pool %u reached its limit of %zu bytes!\n", poolData->poolSize, m_Config.maxPoolSize);
+            return nullptr;
         }
-        it++;
     }
+    blocks = (unsigned int)(slabSize / poolData->blockSize);
+    sizeOfSlabInBytes = (size_t)blocks * poolData->blockSize;
 
-    /* If we reached here, it means something is wrong! */
-    printf("\n\n**ERROR: 0x%x not present in any of the memory pools!!\n\n", ptr);
-    abort();
+    /* Cache coloring: the first block of the slab is placed colorOffset bytes into it. Colors come from
+     * the bytes left after the last block. When these do not make colorCount colors, blocks are given up
+     * for them as long as this costs at most 1 / SM_COLOR_MAX_OVERHEAD of the slab. Offsets are multiples
+     * of the pool alignment, so the blocks stay aligned. */
+    size_t colorStep = poolData->alignment > SM_CACHE_LINE_SIZE ? poolData->alignment : SM_CACHE_LINE_SIZE;
+    size_t colorSpan = (size_t)(m_Config.colorCount - 1) * colorStep;
+    if (colorSpan > slabSize / SM_COLOR_MAX_OVERHEAD)
+    {
+        colorSpan = slabSize / SM_COLOR_MAX_OVERHEAD / colorStep * colorStep;
+    }
+    if (slabSize - sizeOfSlabInBytes < colorSpan && (slabSize - colorSpan) / poolData->blockSize > 0)
+    {
+        blocks = (unsigned int)((slabSize - colorSpan) / poolData->blockSize);
+        sizeOfSlabInBytes = (size_t)blocks * poolData->blockSize;
+    }
+    size_t colors = (slabSize - sizeOfSlabInBytes) / colorStep + 1;
+    if (colors > m_Config.colorCount)
+    {
+        colors = m_Config.colorCount;
+    }
+    size_t colorOffset = (poolData->nextColor % colors) * colorStep;
+
+    Slab_t *slab = allocSlabData(poolData, blocks);
+    void *ptr = slab != nullptr ? allocSlabMemory(slabSize) : nullptr;
+    if (ptr == nullptr || !registerSlab((char *)ptr, slabSize, slab))
+    {
+        printf("\n\n**MEMORY ERROR: expandPool: Failed to add %zu bytes to pool %u!!\n\n", slabSize, poolData->poolSize);
+        if (ptr != nullptr)
+        {
+            unregisterSlab((char *)ptr, slabSize);
+            freeSlabMemory(ptr, slabSize);
+        }
+        free(slab);
+        return nullptr;
+    }
+
+    slab->pool = poolData;
+    slab->baseAddress = (char *)ptr;
+    slab->startAddress = slab->baseAddress + colorOffset;
+    slab->endAddress = slab->startAddress + sizeOfSlabInBytes;
+    slab->slabSize = slabSize;
+    slab->totalBlocks = blocks;
+    slab->usedBlocks = 0;
+    slab->nextFreeBlockInSequence = 0;
+    slab->freeList = nullptr;
+    slab->emptySince = nowMilliseconds();
+    slab->isPurged = false;
+    fillSlabBitmap(slab);
+    linkSlab(poolData, &poolData->emptySlabs, slab);
+    constructObjects(slab);
+
+    poolData->totalSize += slabSize;
+    poolData->remainingSpace += sizeOfSlabInBytes;
+    poolData->totalBlocks += blocks;
+    poolData->freeBlocks += blocks;
+    poolData->slabCount++;
+    poolData->nextColor++;
+
+    unsigned long long nextBlocks = (unsigned long long)poolData->nextSlabBlocks * m_Config.growthFactor;
+    poolData->nextSlabBlocks = nextBlocks > m_Config.maxSlabBlocks ? m_Config.maxSlabBlocks : (unsigned int)nextBlocks;
+
+    //printf("Pool %u expanded by %u blocks\n", poolData->poolSize, blocks);
+    return slab;
+}
+
+/* Returns an empty slab to the OS. The growth policy steps back so the next expansion is smaller. */
+static void releaseSlab(PoolData_t *poolData, Slab_t *slab)
+{
+    size_t sizeOfSlabInBytes = slab->endAddress - slab->startAddress;
+
+    unlinkSlab(&poolData->emptySlabs, slab);
+    destructObjects(slab);
+    unregisterSlab(slab->baseAddress, slab->slabSize);
+    poolData->totalSize -= slab->slabSize;
+    poolData->remainingSpace -= sizeOfSlabInBytes;
+    poolData->totalBlocks -= slab->totalBlocks;
+    poolData->freeBlocks -= slab->totalBlocks;
+    poolData->slabCount--;
+
+    unsigned int previousBlocks = poolData->nextSlabBlocks / m_Config.growthFactor;
+    poolData->nextSlabBlocks = previousBlocks < m_initialPoolSize ? m_initialPoolSize : previousBlocks;
+    if (poolData->nextSlabBlocks == 0)
+    {
+        poolData->nextSlabBlocks = 1;
+    }
+
+    freeSlabMemory(slab->baseAddress, slab->slabSize);
+    free(slab);
+}
+
+/* Gives the pages of an empty slab back to the OS. The slab stays mapped and is reset, because its
+ * free list lived in the discarded pages. Objects of an object cache are destroyed first and
+ * constructed again when the slab is reused. */
+static void purgeSlab(Slab_t *slab)
+{
+    destructObjects(slab);
+    madvise(slab->baseAddress, slab->slabSize, m_Config.useMadvFree ? MADV_FREE : MADV_DONTNEED);
+    slab->freeList = nullptr;
+    slab->nextFreeBlockInSequence = 0;
+    fillSlabBitmap(slab);
+    slab->isPurged = true;
+}
+
+/* Purges the empty slabs of a pool which have been idle for decayTime, or all of them if force is
+ * set. The caller holds the pool lock. */
+static void purgeIdleSlabs(PoolData_t *poolData, unsigned long long now, bool force)
+{
+    if (m_Config.backing != SM_BACKING_MMAP)
+    {
+        return;
+    }
+
+    for (Slab_t *slab = poolData->emptySlabs; slab != nullptr; slab = slab->next)
+    {
+        if (!slab->isPurged && (force || now - slab->emptySince >= m_Config.decayTime))
+        {
+            purgeSlab(slab);
+        }
+    }
+}
+
+/* Returns the empty slab to give back first. Address ordered pools give back their highest slab, which
+ * allocation reaches last. */
+static Slab_t *releasableSlab(PoolData_t *poolData)
+{
+    Slab_t *slab = poolData->emptySlabs;
+    while (poolData->isAddressOrdered && slab->next != nullptr)
+    {
+        slab = slab->next;
+    }
+    return slab;
+}
+
+static bool isBelowShrinkWatermark(PoolData_t *poolData)
+{
+    return (unsigned long long)poolData->usedBlocks * 100 <
+           (unsigned long long)poolData->totalBlocks * m_Config.shrinkWatermark;
+}
+
+/**
+ * The function `shrinkPool` returns every empty slab of a pool to the OS while the pool usage is below
+ * `shrinkWatermark`. The pool always keeps at least one slab. The caller holds the pool lock.
+ *
+ * @param poolData The pool to shrink.
+ */
+void shrinkPool(PoolData_t *poolData)
+{
+    while (poolData->emptySlabs != nullptr && poolData->slabCount > 1 && isBelowShrinkWatermark(poolData))
+    {
+        releaseSlab(poolData, releasableSlab(poolData));
+    }
+}
+
+void displayPoolInfo()
+{
+    pthread_mutex_lock(&m_PoolMapLock);
+    size_t pools = m_PoolMap.size();
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    vector<SM_PoolStats_t> stats(pools);
+    int count = SM_getPoolStats(stats.data(), (int)stats.size());
+
+    printf("\n\n");
+    for (int i = 0; i < count; i++)
+    {
+        printf("Pool %zu\n", stats[i].classSize);
+
+        printf("  allocations                        : %llu\n", stats[i].allocations);
+        printf("  frees                              : %llu\n", stats[i].frees);
+        printf("  liveBlocks                         : %llu\n", stats[i].liveBlocks);
+        printf("  failedAllocations                  : %llu\n", stats[i].failedAllocations);
+        printf("  slabCount                          : %u\n", stats[i].slabCount);
+        printf("  totalSize                          : %zu bytes\n", stats[i].totalSize);
+        printf("  totalBlocks                        : %u\n", stats[i].totalBlocks);
+        printf("  usedBlocks                         : %u\n", stats[i].usedBlocks);
+        printf("  highWaterBlocks                    : %u\n", stats[i].highWaterBlocks);
+        if (stats[i].latencySamples > 0)
+        {
+            printf("  allocation latency samples         :");
+            for (unsigned int j = 0; j < SM_LATENCY_BUCKETS; j++)
+            {
+                if (stats[i].latency[j] > 0)
+                {
+                    printf(" %lluns:%llu", 1ULL << j, stats[i].latency[j]);
+                }
+            }
+            printf("\n");
+        }
+        printf("\n");
+    }
+    printf("\n** Total Pools: %d **\n", count);
+}
+
+/**
+ * The function `SM_getPoolStats` takes a snapshot of the counters of every pool. The counters of the
+ * small size classes are kept per thread without atomic read-modify-write instructions and are only
+ * summed here, so polling this every second costs the allocating threads nothing.
+ *
+ * @param stats Array receiving one entry per pool, in ascending class size.
+ * @param maxPools Number of entries in `stats`.
+ *
+ * @return The number of entries written.
+ */
+int SM_getPoolStats(SM_PoolStats_t *stats, int maxPools)
+{
+    vector<SM_PoolStats_t> classStats(SM_SIZE_CLASS_COUNT);
+    memset(classStats.data(), 0, classStats.size() * sizeof(SM_PoolStats_t));
+
+    pthread_mutex_lock(&m_ThreadCacheListLock);
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        SM_PoolStats_t *classStat = &classStats[i];
+        classStat->allocations = m_RetiredAllocations[i];
+        classStat->frees = m_RetiredFrees[i];
+        classStat->failedAllocations = m_RetiredFailedAllocations[i];
+        for (unsigned int j = 0; j < SM_LATENCY_BUCKETS; j++)
+        {
+            classStat->latency[j] = m_RetiredLatency[i][j];
+        }
+        for (ThreadCache_t *cache = m_ThreadCacheList; cache != nullptr; cache = cache->next)
+        {
+            Magazine_t *magazine = &cache->magazines[i];
+            classStat->allocations += magazine->allocations.load(memory_order_relaxed);
+            classStat->frees += magazine->frees.load(memory_order_relaxed);
+            classStat->failedAllocations += magazine->failedAllocations.load(memory_order_relaxed);
+            for (unsigned int j = 0; j < SM_LATENCY_BUCKETS; j++)
+            {
+                classStat->latency[j] += magazine->latency[j].load(memory_order_relaxed);
+            }
+        }
+    }
+    pthread_mutex_unlock(&m_ThreadCacheListLock);
+
+    int count = 0;
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end() && count < maxPools; it++)
+    {
+        PoolData_t *poolData = it->second;
+        SM_PoolStats_t *stat = &stats[count++];
+
+        if (poolData->cacheIndex >= 0)
+        {
+            *stat = classStats[poolData->cacheIndex];
+        }
+        else
+        {
+            memset(stat, 0, sizeof(SM_PoolStats_t));
+            stat->frees = poolData->frees.load(memory_order_relaxed);
+            for (unsigned int j = 0; j < SM_LATENCY_BUCKETS; j++)
+            {
+                stat->latency[j] = poolData->latency[j].load(memory_order_relaxed);
+            }
+        }
+
+        pthread_mutex_lock(&poolData->lock);
+        if (poolData->cacheIndex < 0)
+        {
+            stat->allocations = poolData->totalAllocationsFromThisPool;
+            stat->failedAllocations = poolData->failedAllocations;
+        }
+        stat->classSize = poolData->poolSize;
+        stat->usedBlocks = poolData->usedBlocks;
+        stat->highWaterBlocks = poolData->highWaterBlocks;
+        stat->totalBlocks = poolData->totalBlocks;
+        stat->slabCount = poolData->slabCount;
+        stat->totalSize = poolData->totalSize;
+        pthread_mutex_unlock(&poolData->lock);
+
+        /* Counters of different threads are read one after the other, so a block freed by another
+         * thread than the one which allocated it can be seen freed before it is seen allocated */
+        stat->liveBlocks = stat->allocations > stat->frees ? stat->allocations - stat->frees : 0;
+        stat->latencySamples = 0;
+        for (unsigned int j = 0; j < SM_LATENCY_BUCKETS; j++)
+        {
+            stat->latencySamples += stat->latency[j];
+        }
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    return count;
+}
+
+/**
+ * The function `SM_setLatencySampling` makes every thread time one SM_alloc call out of `interval`
+ * and count its latency in the histogram of SM_getPoolStats. 0 disables sampling, which is the default.
+ */
+void SM_setLatencySampling(unsigned int interval)
+{
+    m_LatencySampleInterval.store(interval, memory_order_relaxed);
+}
+
+/* Blocks covering a peak of peakBlocks with headroom percent to spare */
+static unsigned int provisionedBlocks(unsigned int peakBlocks, unsigned int headroom)
+{
+    unsigned long long blocks = ((unsigned long long)peakBlocks * (100 + headroom) + 99) / 100;
+    if (blocks == 0)
+    {
+        return 1;
+    }
+    return blocks > UINT_MAX ? UINT_MAX : (unsigned int)blocks;
+}
+
+/**
+ * The function `SM_getPoolProfile` recommends the pools to create at start-up and their initial
+ * blocks, from the allocations and high water mark of every pool so far. Pools which never served an
+ * allocation are left out. The blocks cached by thread magazines count as used, so the peaks include
+ * them.
+ *
+ * @param profile Array receiving one entry per recommended pool, in ascending class size.
+ * @param maxPools Number of entries in `profile`.
+ * @param headroom Percent added to the peak of every pool, for example 25.
+ *
+ * @return The number of entries stored in `profile`.
+ */
+int SM_getPoolProfile(SM_PoolProfile_t *profile, int maxPools, unsigned int headroom)
+{
+    pthread_mutex_lock(&m_PoolMapLock);
+    size_t pools = m_PoolMap.size();
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    vector<SM_PoolStats_t> stats(pools);
+    int count = SM_getPoolStats(stats.data(), (int)stats.size());
+
+    int recommended = 0;
+    for (int i = 0; i < count && recommended < maxPools; i++)
+    {
+        if (stats[i].allocations == 0 || stats[i].highWaterBlocks == 0)
+        {
+            continue;
+        }
+        profile[recommended].poolSize = (unsigned int)stats[i].classSize;
+        profile[recommended].initialBlocks = provisionedBlocks(stats[i].highWaterBlocks, headroom);
+        recommended++;
+    }
+    return recommended;
+}
+
+/**
+ * The function `displayPoolProfile` prints the profile recommended by SM_getPoolProfile as code to
+ * paste in place of a fixed list of pools, with the usage each entry is based on.
+ */
+void displayPoolProfile(unsigned int headroom)
+{
+    pthread_mutex_lock(&m_PoolMapLock);
+    size_t pools = m_PoolMap.size();
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    vector<SM_PoolStats_t> stats(pools);
+    int count = SM_getPoolStats(stats.data(), (int)stats.size());
+
+    printf("\nRecommended pools (peak + %u%%):\n", headroom);
+    printf("const SM_PoolProfile_t PROFILE[] = {\n");
+    for (int i = 0; i < count; i++)
+    {
+        if (stats[i].allocations == 0 || stats[i].highWaterBlocks == 0)
+        {
+            continue;
+        }
+        printf("    { %5zu, %9u },   // %llu allocations, peak %u of %u blocks\n", stats[i].classSize,
+               provisionedBlocks(stats[i].highWaterBlocks, headroom), stats[i].allocations,
+               stats[i].highWaterBlocks, stats[i].totalBlocks);
+    }
+    printf("};\n");
+    printf("initStorageManagerWithProfile(%u, sizeof(PROFILE) / sizeof(PROFILE[0]), PROFILE);\n\n", m_initialPoolSize);
+}
+
+/**
+ * The function `SM_getSizeClassWaste` reports the internal fragmentation of every size class with at
+ * least one allocation: the bytes handed out beyond what SM_alloc was asked for. Use it to tune the
+ * size class spacing.
+ *
+ * @param waste Array receiving one entry per size class.
+ * @param maxClasses Number of entries in `waste`.
+ *
+ * @return The number of entries written.
+ */
+int SM_getSizeClassWaste(SM_SizeClassWaste_t *waste, int maxClasses)
+{
+    int count = 0;
+
+    pthread_mutex_lock(&m_ThreadCacheListLock);
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT && count < maxClasses; i++)
+    {
+        unsigned long long allocations = m_RetiredAllocations[i];
+        unsigned long long requestedBytes = m_RetiredRequestedBytes[i];
+        for (ThreadCache_t *cache = m_ThreadCacheList; cache != nullptr; cache = cache->next)
+        {
+            allocations += cache->magazines[i].allocations.load(memory_order_relaxed);
+            requestedBytes += cache->magazines[i].requestedBytes.load(memory_order_relaxed);
+        }
+        if (allocations == 0)
+        {
+            continue;
+        }
+        waste[count].classSize = m_SizeClasses.size[i];
+        waste[count].allocations = allocations;
+        waste[count].requestedBytes = requestedBytes;
+        waste[count].wastedBytes = allocations * m_SizeClasses.size[i] - requestedBytes;
+        count++;
+    }
+    pthread_mutex_unlock(&m_ThreadCacheListLock);
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.lower_bound(SM_MAX_SMALL_SIZE + 1);
+         it != m_PoolMap.end() && count < maxClasses; it++)
+    {
+        PoolData_t *poolData = it->second;
+        pthread_mutex_lock(&poolData->lock);
+        if (poolData->totalAllocationsFromThisPool > 0)
+        {
+            waste[count].classSize = poolData->poolSize;
+            waste[count].allocations = poolData->totalAllocationsFromThisPool;
+            waste[count].requestedBytes = poolData->requestedBytes;
+            waste[count].wastedBytes = poolData->totalAllocationsFromThisPool * (unsigned long long)poolData->poolSize - poolData->requestedBytes;
+            count++;
+        }
+        pthread_mutex_unlock(&poolData->lock);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    return count;
+}
+
+void displaySizeClassWaste()
+{
+    SM_SizeClassWaste_t waste[SM_SIZE_CLASS_COUNT + 64];
+    int count = SM_getSizeClassWaste(waste, SM_SIZE_CLASS_COUNT + 64);
+
+    printf("\n%-10s %-16s %-20s %-20s %s\n", "Class", "Allocations", "Requested bytes", "Wasted bytes", "Waste");
+    for (int i = 0; i < count; i++)
+    {
+        unsigned long long handedOut = waste[i].requestedBytes + waste[i].wastedBytes;
+        printf("%-10zu %-16llu %-20llu %-20llu %.1f%%\n", waste[i].classSize, waste[i].allocations,
+               waste[i].requestedBytes, waste[i].wastedBytes, handedOut ? 100.0 * waste[i].wastedBytes / handedOut : 0.0);
+    }
+}
+
+/* Applies the decayTime policy to every pool and object cache, at most once per decayTime, so that the
+ * empty slabs of pools which went quiet are purged even if the application never calls SM_purge. Called
+ * by the allocation slow path without any lock held. Pools locked by another thread are left to the
+ * next sweep. */
+static void decayQuietPools()
+{
+    if (m_Config.backing != SM_BACKING_MMAP || m_Config.decayTime == 0)
+    {
+        return;
+    }
+
+    unsigned long long now = nowMilliseconds();
+    unsigned long long last = m_LastDecaySweep.load(memory_order_relaxed);
+    if (now - last < m_Config.decayTime || !m_LastDecaySweep.compare_exchange_strong(last, now, memory_order_relaxed))
+    {
+        return;
+    }
+
+    if (pthread_mutex_trylock(&m_PoolMapLock) != 0)
+    {
+        return;
+    }
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        if (pthread_mutex_trylock(&it->second->lock) == 0)
+        {
+            purgeIdleSlabs(it->second, now, false);
+            pthread_mutex_unlock(&it->second->lock);
+        }
+    }
+    for (SM_ObjectCache_t *cache = m_ObjectCacheList; cache != nullptr; cache = cache->next)
+    {
+        if (pthread_mutex_trylock(&cache->pool->lock) == 0)
+        {
+            purgeIdleSlabs(cache->pool, now, false);
+            pthread_mutex_unlock(&cache->pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+}
+
+/**
+ * The function `SM_purge` gives the pages of idle empty slabs back to the OS. Slabs are also checked
+ * when a slab empties and, at most once per decayTime, whenever a magazine is refilled or a large
+ * block is allocated, so only a process which stops allocating altogether needs to call it to apply
+ * the decayTime policy. With `force`, every empty slab is purged now.
+ */
+void SM_purge(bool force)
+{
+    unsigned long long now = nowMilliseconds();
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        pthread_mutex_lock(&it->second->lock);
+        shrinkPool(it->second);
+        purgeIdleSlabs(it->second, now, force);
+        pthread_mutex_unlock(&it->second->lock);
+    }
+    for (SM_ObjectCache_t *cache = m_ObjectCacheList; cache != nullptr; cache = cache->next)
+    {
+        pthread_mutex_lock(&cache->pool->lock);
+        shrinkPool(cache->pool);
+        purgeIdleSlabs(cache->pool, now, force);
+        pthread_mutex_unlock(&cache->pool->lock);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+}
+
+/**
+ * The function `SM_setPoolAlignment` aligns every block of the pool serving requests of `size` bytes
+ * to `alignment`, for example 64 to keep per-thread structures off each other's cache lines or 32 for
+ * AVX data. The block size is rounded up to a multiple of the alignment. It must be called before the
+ * first block of the pool is allocated, typically right after initStorageManager.
+ *
+ * @param size A request size served by the pool.
+ * @param alignment A power of two up to SM_REGION_SIZE.
+ *
+ * @return true on success, false if the alignment is invalid or the pool already handed out blocks.
+ */
+bool SM_setPoolAlignment(size_t size, unsigned int alignment)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > SM_REGION_SIZE ||
+        size > UINT_MAX || SM_sizeClassSize(size) > UINT_MAX)
+    {
+        printf("ERROR: SM_setPoolAlignment: Invalid alignment %u for %zu bytes!\n", alignment, size);
+        return false;
+    }
+
+    PoolData_t *poolData = findOrCreatePool(size);
+
+    pthread_mutex_lock(&poolData->lock);
+    if (poolData->totalAllocationsFromThisPool != 0)
+    {
+        pthread_mutex_unlock(&poolData->lock);
+        printf("ERROR: SM_setPoolAlignment: Pool %u is already in use!\n", poolData->poolSize);
+        return false;
+    }
+
+    /* No block was handed out, so all slabs are empty and can be laid out again */
+    while (poolData->emptySlabs != nullptr)
+    {
+        releaseSlab(poolData, poolData->emptySlabs);
+    }
+
+    size_t blockSize = poolData->poolSize < sizeof(FreeBlock_t) ? sizeof(FreeBlock_t) : poolData->poolSize;
+    blockSize = (blockSize + alignment - 1) & ~((size_t)alignment - 1);
+    poolData->blockSize = (unsigned int)blockSize;
+    poolData->alignment = naturalAlignment(poolData->blockSize);
+    poolData->nextSlabBlocks = m_initialPoolSize > 0 ? m_initialPoolSize : 1;
+
+    bool isExpanded = expandPool(poolData) != nullptr;
+    pthread_mutex_unlock(&poolData->lock);
+
+    return isExpanded;
+}
+
+static void destroySlabList(Slab_t *slab)
+{
+    while (slab != nullptr)
+    {
+        Slab_t *next = slab->next;
+        destructObjects(slab);
+        unregisterSlab(slab->baseAddress, slab->slabSize);
+        freeSlabMemory(slab->baseAddress, slab->slabSize);
+        free(slab);
+        slab = next;
+    }
+}
+
+/* Destroys every object of a cache and returns its slabs to the OS. The caller unlinked the cache. */
+static void destroyObjectCache(SM_ObjectCache_t *cache)
+{
+    PoolData_t *poolData = cache->pool;
+    destroySlabList(poolData->partialSlabs);
+    destroySlabList(poolData->emptySlabs);
+    destroySlabList(poolData->fullSlabs);
+    freePoolData(poolData);
+    free(cache);
+}
+
+/* Returns the slabs of every pool of a region to the OS and releases it. The caller unlinked the region. */
+static void destroyRegion(SM_Region_t *region)
+{
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        if (region->pools[i] != nullptr)
+        {
+            destroySlabList(region->pools[i]->partialSlabs);
+            destroySlabList(region->pools[i]->emptySlabs);
+            destroySlabList(region->pools[i]->fullSlabs);
+            freePoolData(region->pools[i]);
+        }
+    }
+    for (size_t i = 0; i < region->largePools.size(); i++)
+    {
+        destroySlabList(region->largePools[i]->partialSlabs);
+        destroySlabList(region->largePools[i]->emptySlabs);
+        destroySlabList(region->largePools[i]->fullSlabs);
+        freePoolData(region->largePools[i]);
+    }
+    region->~SM_Region_t();
+    free(region);
+}
+
+/**
+ * The function `destroyStorageManager` returns every slab and pool to the OS. All blocks become
+ * invalid, including the ones cached by other threads, so no thread may use the storage manager
+ * while or after it runs. initStorageManager can be called again afterwards.
+ */
+void destroyStorageManager()
+{
+    pthread_mutex_lock(&m_ThreadCacheListLock);
+    for (ThreadCache_t *cache = m_ThreadCacheList; cache != nullptr; cache = cache->next)
+    {
+        for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+        {
+            cache->magazines[i].count = 0;
+        }
+    }
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        t_ThreadCache.magazines[i].count = 0;
+    }
+    pthread_mutex_unlock(&m_ThreadCacheListLock);
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        PoolData_t *poolData = it->second;
+        destroySlabList(poolData->partialSlabs);
+        destroySlabList(poolData->emptySlabs);
+        destroySlabList(poolData->fullSlabs);
+        freePoolData(poolData);
+    }
+    m_PoolMap.clear();
+    while (m_ObjectCacheList != nullptr)
+    {
+        SM_ObjectCache_t *cache = m_ObjectCacheList;
+        m_ObjectCacheList = cache->next;
+        destroyObjectCache(cache);
+    }
+    while (m_RegionList != nullptr)
+    {
+        SM_Region_t *region = m_RegionList;
+        m_RegionList = region->next;
+        destroyRegion(region);
+    }
+    t_Region = nullptr;
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        m_PoolTable[i].store(nullptr, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    pthread_mutex_lock(&m_DirectoryLock);
+    for (size_t i = 0; i < ((size_t)1 << SM_DIRECTORY_ROOT_BITS); i++)
+    {
+        delete[] m_SlabDirectory[i].exchange(nullptr, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&m_DirectoryLock);
+
+    printf("StorageManager:: Destroyed\n");
+}
+
+/* Adds value to a counter which only the calling thread writes. A relaxed load and store is enough and,
+ * unlike fetch_add, is not a locked instruction. */
+static inline void addThreadCounter(atomic<unsigned long long> *counter, unsigned long long value)
+{
+    counter->store(counter->load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static inline unsigned int latencyBucket(unsigned long long ns)
+{
+    unsigned int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    return bucket < SM_LATENCY_BUCKETS ? bucket : SM_LATENCY_BUCKETS - 1;
+}
+
+/* Takes one block out of a pool. The caller holds the pool lock. */
+static void *allocBlockFromPool(PoolData_t *poolData)
+{
+    /* Allocate from a partially used slab first so empty slabs can be given back */
+    Slab_t *slab = poolData->partialSlabs;
+    if (slab == nullptr)
+    {
+        slab = poolData->emptySlabs;
+        if (slab == nullptr)
+        {
+            slab = expandPool(poolData);
+            if (slab == nullptr)
+            {
+                return nullptr;
+            }
+        }
+    }
+
+    if (slab->isPurged)
+    {
+        slab->isPurged = false;
+        constructObjects(slab);
+    }
+
+    char *ptr = nullptr;
+
+    if (slab->bitmap != nullptr)
+    {
+        ptr = findAddressFromBlock(takeLowestBlock(slab), slab);
+    }
+    else if (slab->freeList != nullptr)
+    {
+        /* Allocating a block which was freed earlier. Unlink it from the head of the free list. */
+        ptr = blockOfLink(poolData, slab->freeList);
+        slab->freeList = slab->freeList->next;
+        //printf(">> From freed block\n");
+    }
+    else
+    {
+        /* Allocating from free blocks in sequnce */
+        ptr = findAddressFromBlock(slab->nextFreeBlockInSequence, slab);
+        //printf(">> From sequence\n");
+        slab->nextFreeBlockInSequence++;
+    }
+
+    //printf("Allocated %p (block %u) in pool %u\n", ptr, poolData->usedBlocks, poolData->poolSize);
+
+    Slab_t **oldList = slabListFor(poolData, slab, slab->usedBlocks);
+    slab->usedBlocks++;
+    Slab_t **newList = slabListFor(poolData, slab, slab->usedBlocks);
+    if (oldList != newList)
+    {
+        unlinkSlab(oldList, slab);
+        linkSlab(poolData, newList, slab);
+    }
+
+    poolData->freeBlocks--;
+    poolData->usedBlocks++;
+    if (poolData->usedBlocks > poolData->highWaterBlocks)
+    {
+        poolData->highWaterBlocks = poolData->usedBlocks;
+    }
+    if (poolData->usedBlocks > poolData->recentHighWaterBlocks)
+    {
+        poolData->recentHighWaterBlocks = poolData->usedBlocks;
+    }
+    poolData->remainingSpace -= poolData->poolSize;
+    poolData->totalAllocationsFromThisPool++;
+
+    return ptr;
+}
+
+/* Takes up to count blocks out of a pool into out and returns how many were taken. Blocks are carved
+ * from the never used part of a slab first so that they are consecutive in memory, then taken from its
+ * free list. The slab lists and pool counters are updated once per slab and once per call. The caller
+ * holds the pool lock. */
+static unsigned int allocBlocksFromPool(PoolData_t *poolData, unsigned int count, void **out)
+{
+    unsigned int allocated = 0;
+
+    while (allocated < count)
+    {
+        Slab_t *slab = poolData->partialSlabs;
+        if (slab == nullptr)
+        {
+            slab = poolData->emptySlabs;
+            if (slab == nullptr)
+            {
+                slab = expandPool(poolData);
+                if (slab == nullptr)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (slab->isPurged)
+        {
+            slab->isPurged = false;
+            constructObjects(slab);
+        }
+
+        unsigned int wanted = count - allocated;
+        if (slab->bitmap != nullptr)
+        {
+            unsigned int taken = 0;
+            while (taken < wanted && slab->usedBlocks + taken < slab->totalBlocks)
+            {
+                out[allocated++] = findAddressFromBlock(takeLowestBlock(slab), slab);
+                taken++;
+            }
+
+            Slab_t **oldList = slabListFor(poolData, slab, slab->usedBlocks);
+            slab->usedBlocks += taken;
+            Slab_t **newList = slabListFor(poolData, slab, slab->usedBlocks);
+            if (oldList != newList)
+            {
+                unlinkSlab(oldList, slab);
+                linkSlab(poolData, newList, slab);
+            }
+            continue;
+        }
+
+        unsigned int sequence = slab->totalBlocks - slab->nextFreeBlockInSequence;
+        unsigned int taken = wanted < sequence ? wanted : sequence;
+
+        char *ptr = findAddressFromBlock(slab->nextFreeBlockInSequence, slab);
+        for (unsigned int i = 0; i < taken; i++)
+        {
+            out[allocated++] = ptr;
+            ptr += poolData->blockSize;
+        }
+        slab->nextFreeBlockInSequence += taken;
+
+        while (taken < wanted && slab->freeList != nullptr)
+        {
+            out[allocated++] = blockOfLink(poolData, slab->freeList);
+            slab->freeList = slab->freeList->next;
+            taken++;
+        }
+
+        Slab_t **oldList = slabListFor(poolData, slab, slab->usedBlocks);
+        slab->usedBlocks += taken;
+        Slab_t **newList = slabListFor(poolData, slab, slab->usedBlocks);
+        if (oldList != newList)
+        {
+            unlinkSlab(oldList, slab);
+            linkSlab(poolData, newList, slab);
+        }
+    }
+
+    poolData->freeBlocks -= allocated;
+    poolData->usedBlocks += allocated;
+    if (poolData->usedBlocks > poolData->highWaterBlocks)
+    {
+        poolData->highWaterBlocks = poolData->usedBlocks;
+    }
+    if (poolData->usedBlocks > poolData->recentHighWaterBlocks)
+    {
+        poolData->recentHighWaterBlocks = poolData->usedBlocks;
+    }
+    poolData->remainingSpace -= (size_t)allocated * poolData->poolSize;
+    poolData->totalAllocationsFromThisPool += allocated;
+
+    return allocated;
+}
+
+/* Gives one block back to the slab it was allocated from. The caller holds the pool lock. */
+static void deallocBlockToPool(Slab_t *slab, void *ptr)
+{
+    PoolData_t *poolData = slab->pool;
+
+    if (slab->bitmap != nullptr)
+    {
+        putBlock(slab, ptr);
+    }
+    else
+    {
+        /* Mark this address as free by pushing it on the head of the free list */
+        FreeBlock_t *freeBlock = linkOfBlock(poolData, ptr);
+        freeBlock->next = slab->freeList;
+        slab->freeList = freeBlock;
+    }
+
+    Slab_t **oldList = slabListFor(poolData, slab, slab->usedBlocks);
+    slab->usedBlocks--;
+    Slab_t **newList = slabListFor(poolData, slab, slab->usedBlocks);
+    if (oldList != newList)
+    {
+        unlinkSlab(oldList, slab);
+        linkSlab(poolData, newList, slab);
+    }
+
+    poolData->freeBlocks++;
+    poolData->usedBlocks--;
+    poolData->remainingSpace += poolData->poolSize;
+
+    if (slab->usedBlocks == 0)
+    {
+        unsigned long long now = nowMilliseconds();
+        slab->emptySince = now;
+        shrinkPool(poolData);
+        purgeIdleSlabs(poolData, now, false);
+    }
+
+    //printf("Deallocated %p block from pool %u\n", ptr, poolData->poolSize);
+}
+
+static void destroyThreadCache(void *)
+{
+    flushThreadCache();
+
+    pthread_mutex_lock(&m_ThreadCacheListLock);
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        m_RetiredAllocations[i] += t_ThreadCache.magazines[i].allocations.load(memory_order_relaxed);
+        m_RetiredRequestedBytes[i] += t_ThreadCache.magazines[i].requestedBytes.load(memory_order_relaxed);
+        m_RetiredFrees[i] += t_ThreadCache.magazines[i].frees.load(memory_order_relaxed);
+        m_RetiredFailedAllocations[i] += t_ThreadCache.magazines[i].failedAllocations.load(memory_order_relaxed);
+        for (unsigned int j = 0; j < SM_LATENCY_BUCKETS; j++)
+        {
+            m_RetiredLatency[i][j] += t_ThreadCache.magazines[i].latency[j].load(memory_order_relaxed);
+        }
+    }
+    if (t_ThreadCache.prev != nullptr)
+    {
+        t_ThreadCache.prev->next = t_ThreadCache.next;
+    }
+    else
+    {
+        m_ThreadCacheList = t_ThreadCache.next;
+    }
+    if (t_ThreadCache.next != nullptr)
+    {
+        t_ThreadCache.next->prev = t_ThreadCache.prev;
+    }
+    pthread_mutex_unlock(&m_ThreadCacheListLock);
+}
+
+static void createThreadCacheKey()
+{
+    pthread_key_create(&m_ThreadCacheKey, destroyThreadCache);
+}
+
+/* Makes sure the blocks cached by the calling thread are given back when it exits */
+static void registerThreadCache()
+{
+    pthread_once(&m_ThreadCacheKeyOnce, createThreadCacheKey);
+    pthread_setspecific(m_ThreadCacheKey, &t_ThreadCache);
+    t_ThreadCache.isRegistered = true;
+
+    pthread_mutex_lock(&m_ThreadCacheListLock);
+    t_ThreadCache.prev = nullptr;
+    t_ThreadCache.next = m_ThreadCacheList;
+    if (m_ThreadCacheList != nullptr)
+    {
+        m_ThreadCacheList->prev = &t_ThreadCache;
+    }
+    m_ThreadCacheList = &t_ThreadCache;
+    pthread_mutex_unlock(&m_ThreadCacheListLock);
+}
+
+/* Pushes the chain of blocks from first to last on the remote free list of a pool. Without contention
+ * this is a single CAS. */
+static void pushRemoteFrees(PoolData_t *poolData, FreeBlock_t *first, FreeBlock_t *last)
+{
+    FreeBlock_t *head = poolData->remoteFreeList.load(memory_order_relaxed);
+    do
+    {
+        last->next = head;
+    } while (!poolData->remoteFreeList.compare_exchange_weak(head, first, memory_order_release, memory_order_relaxed));
+}
+
+/* Gives every block on the remote free list back to its slab. The caller holds the pool lock. */
+static void drainRemoteFrees(PoolData_t *poolData)
+{
+    FreeBlock_t *block = poolData->remoteFreeList.exchange(nullptr, memory_order_acquire);
+    while (block != nullptr)
+    {
+        FreeBlock_t *next = block->next;
+        deallocBlockToPool(findSlabFromAddress(block), blockOfLink(poolData, block));
+        block = next;
+    }
+}
+
+/* Moves the count oldest blocks of a magazine back to their pool. The most recently freed blocks
+ * stay in the magazine as they are the most likely to still be in the CPU cache. The blocks are
+ * handed over on the remote free list, so a thread freeing what another thread allocated neither
+ * waits for the pool lock nor touches the slabs. */
+static void flushMagazine(PoolData_t *poolData, Magazine_t *magazine, unsigned int count)
+{
+    for (unsigned int i = 0; i + 1 < count; i++)
+    {
+        ((FreeBlock_t *)magazine->blocks[i])->next = (FreeBlock_t *)magazine->blocks[i + 1];
+    }
+    pushRemoteFrees(poolData, (FreeBlock_t *)magazine->blocks[0], (FreeBlock_t *)magazine->blocks[count - 1]);
+
+    magazine->count -= count;
+    memmove(magazine->blocks, magazine->blocks + count, magazine->count * sizeof(void *));
+}
+
+/* Fills an empty magazine with a batch of blocks from the pool of size bytes and returns one of them */
+static void *refillMagazine(size_t size, Magazine_t *magazine)
+{
+    if (!t_ThreadCache.isRegistered)
+    {
+        registerThreadCache();
+    }
+
+    decayQuietPools();
+
+    PoolData_t *poolData = findOrCreatePool(size);
+
+    /* Take the blocks freed by other threads first. Whatever does not fit in the magazine goes back
+     * to the slabs. */
+    if (poolData->remoteFreeList.load(memory_order_relaxed) != nullptr)
+    {
+        FreeBlock_t *block = poolData->remoteFreeList.exchange(nullptr, memory_order_acquire);
+        while (block != nullptr && magazine->count < SM_MAGAZINE_SIZE)
+        {
+            magazine->blocks[magazine->count++] = block;
+            block = block->next;
+        }
+        if (block != nullptr)
+        {
+            pthread_mutex_lock(&poolData->lock);
+            while (block != nullptr)
+            {
+                FreeBlock_t *next = block->next;
+                deallocBlockToPool(findSlabFromAddress(block), block);
+                block = next;
+            }
+            pthread_mutex_unlock(&poolData->lock);
+        }
+        if (magazine->count > 0)
+        {
+            return magazine->blocks[--magazine->count];
+        }
+    }
+
+    pthread_mutex_lock(&poolData->lock);
+    while (magazine->count < SM_MAGAZINE_BATCH)
+    {
+        void *ptr = allocBlockFromPool(poolData);
+        if (ptr == nullptr)
+        {
+            break;
+        }
+        magazine->blocks[magazine->count++] = ptr;
+    }
+    pthread_mutex_unlock(&poolData->lock);
+
+    if (magazine->count == 0)
+    {
+        return nullptr;
+    }
+    return magazine->blocks[--magazine->count];
+}
+
+/* Drains the remote free list of a pool if it has blocks waiting */
+static void drainPendingRemoteFrees(PoolData_t *poolData)
+{
+    if (poolData->remoteFreeList.load(memory_order_relaxed) != nullptr)
+    {
+        pthread_mutex_lock(&poolData->lock);
+        drainRemoteFrees(poolData);
+        pthread_mutex_unlock(&poolData->lock);
+    }
+}
+
+/**
+ * The function `flushThreadCache` gives every block cached by the calling thread back to its pool,
+ * together with the blocks waiting on the remote free lists of all pools and object caches. It is
+ * called automatically when a thread exits.
+ */
+void flushThreadCache()
+{
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        Magazine_t *magazine = &t_ThreadCache.magazines[i];
+        if (magazine->count > 0)
+        {
+            PoolData_t *poolData = m_PoolTable[i].load(memory_order_acquire);
+
+            pthread_mutex_lock(&poolData->lock);
+            for (unsigned int j = 0; j < magazine->count; j++)
+            {
+                deallocBlockToPool(findSlabFromAddress(magazine->blocks[j]), magazine->blocks[j]);
+            }
+            pthread_mutex_unlock(&poolData->lock);
+
+            magazine->count = 0;
+        }
+    }
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        drainPendingRemoteFrees(it->second);
+    }
+    /* SM_dealloc of an object sends it to the remote free list of its cache's private pool */
+    for (SM_ObjectCache_t *cache = m_ObjectCacheList; cache != nullptr; cache = cache->next)
+    {
+        drainPendingRemoteFrees(cache->pool);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+}
+
+/* Brings the slabs of a pool close to its recent peak. The caller holds the pool lock. */
+static void tunePool(PoolData_t *poolData, unsigned int headroom)
+{
+    unsigned int target = provisionedBlocks(poolData->recentHighWaterBlocks, headroom);
+
+    /* Give back the empty slabs the peak did not need */
+    while (poolData->emptySlabs != nullptr && poolData->slabCount > 1)
+    {
+        Slab_t *slab = releasableSlab(poolData);
+        if (poolData->totalBlocks - slab->totalBlocks < target)
+        {
+            break;
+        }
+        releaseSlab(poolData, slab);
+    }
+
+    /* Reach the peak with the next expansion instead of several geometric steps */
+    if (poolData->totalBlocks < target)
+    {
+        unsigned int missing = target - poolData->totalBlocks;
+        poolData->nextSlabBlocks = missing < m_Config.maxSlabBlocks ? missing : m_Config.maxSlabBlocks;
+    }
+
+    poolData->recentHighWaterBlocks = poolData->usedBlocks;
+}
+
+/**
+ * The function `SM_autoTune` resizes every pool to the peak usage it had since the previous call,
+ * plus `headroom` percent: empty slabs beyond it are returned to the OS, and a pool below it gets a
+ * next slab that covers the difference at once. Called periodically, for example next to SM_purge,
+ * it keeps every size class provisioned close to its actual peak. With a shrinkWatermark of 0, empty
+ * slabs are only given back here.
+ */
+void SM_autoTune(unsigned int headroom)
+{
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        pthread_mutex_lock(&it->second->lock);
+        drainRemoteFrees(it->second);
+        tunePool(it->second, headroom);
+        pthread_mutex_unlock(&it->second->lock);
+    }
+    for (SM_ObjectCache_t *cache = m_ObjectCacheList; cache != nullptr; cache = cache->next)
+    {
+        pthread_mutex_lock(&cache->pool->lock);
+        drainRemoteFrees(cache->pool);
+        tunePool(cache->pool, headroom);
+        pthread_mutex_unlock(&cache->pool->lock);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+}
+
+/* Takes a block of size bytes from the calling thread's magazine of the small size class sizeClass */
+static inline void *allocFromMagazine(unsigned int sizeClass, size_t size)
+{
+    Magazine_t *magazine = &t_ThreadCache.magazines[sizeClass];
+    if (magazine->count > 0)
+    {
+        addThreadCounter(&magazine->allocations, 1);
+        addThreadCounter(&magazine->requestedBytes, size);
+        return magazine->blocks[--magazine->count];
+    }
+    void *ptr = refillMagazine(size, magazine);
+    if (ptr != nullptr)
+    {
+        addThreadCounter(&magazine->allocations, 1);
+        addThreadCounter(&magazine->requestedBytes, size);
+    }
+    else
+    {
+        addThreadCounter(&magazine->failedAllocations, 1);
+    }
+    return ptr;
+}
+
+/* Puts a freed block of a cached pool in the calling thread's magazine */
+static inline void freeToMagazine(PoolData_t *poolData, void *ptr)
+{
+    Magazine_t *magazine = &t_ThreadCache.magazines[poolData->cacheIndex];
+    if (magazine->count == SM_MAGAZINE_SIZE)
+    {
+        flushMagazine(poolData, magazine, SM_MAGAZINE_BATCH);
+    }
+    else if (!t_ThreadCache.isRegistered)
+    {
+        registerThreadCache();
+    }
+    magazine->blocks[magazine->count++] = ptr;
+    addThreadCounter(&magazine->frees, 1);
+}
+
+/* Returns the private pool of a region serving requests of size bytes, creating it if it is not present */
+static PoolData_t *findOrCreateRegionPool(SM_Region_t *region, size_t size)
+{
+    unsigned int classSize = (unsigned int)SM_sizeClassSize(size);
+    PoolData_t **slot = nullptr;
+    if (size <= SM_MAX_SMALL_SIZE)
+    {
+        slot = &region->pools[SM_sizeClassIndex(size)];
+        if (*slot != nullptr)
+        {
+            return *slot;
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < region->largePools.size(); i++)
+        {
+            if (region->largePools[i]->poolSize == classSize)
+            {
+                return region->largePools[i];
+            }
+        }
+    }
+
+    PoolData_t *poolData = allocPoolData();
+    if (poolData == nullptr)
+    {
+        printf("\n\n**MEMORY ERROR: SM_region_alloc: Failed to create pool %u!!\n\n", classSize);
+        return nullptr;
+    }
+
+    /* The pool color comes from m_NextPoolColor */
+    pthread_mutex_lock(&m_PoolMapLock);
+    resetPoolData(classSize, poolData);
+    pthread_mutex_unlock(&m_PoolMapLock);
+    poolData->region = region;
+    poolData->isAddressOrdered = false;
+    poolData->nextSlabBlocks = 1;   // The first slab is one region. Later slabs grow with growthFactor.
+
+    if (slot != nullptr)
+    {
+        *slot = poolData;
+    }
+    else
+    {
+        region->largePools.push_back(poolData);
+    }
+    return poolData;
+}
+
+/* Retires the slab a region pool was carving blocks from and makes the next empty slab current,
+ * adding one if there is none. The current slab is the only one on partialSlabs. */
+static Slab_t *nextRegionSlab(PoolData_t *poolData)
+{
+    Slab_t *slab = poolData->partialSlabs;
+    if (slab != nullptr)
+    {
+        unlinkSlab(&poolData->partialSlabs, slab);
+        pushSlab(&poolData->fullSlabs, slab);
+    }
+
+    slab = poolData->emptySlabs;
+    if (slab == nullptr)
+    {
+        slab = expandPool(poolData);
+        if (slab == nullptr)
+        {
+            return nullptr;
+        }
+    }
+    unlinkSlab(&poolData->emptySlabs, slab);
+    pushSlab(&poolData->partialSlabs, slab);
+    return slab;
+}
+
+/* Serves an allocation of a region. Blocks are carved in sequence from the current slab of the pool
+ * of their class, so nothing but nextFreeBlockInSequence is updated per block. The high water mark
+ * and allocation count of the pool are brought up to date by SM_region_reset. */
+static inline void *allocFromRegion(SM_Region_t *region, size_t size)
+{
+    PoolData_t *poolData = nullptr;
+    if (size <= SM_MAX_SMALL_SIZE)
+    {
+        poolData = region->pools[m_SizeClasses.index[(size + SM_SIZE_CLASS_QUANTUM - 1) >> SM_SIZE_CLASS_QUANTUM_SHIFT]];
+    }
+    else if (size > UINT_MAX || SM_sizeClassSize(size) > UINT_MAX)
+    {
+        printf("ERROR: SM_region_alloc: %zu bytes is larger than the largest pool!\n", size);
+        return nullptr;
+    }
+    if (poolData == nullptr)
+    {
+        poolData = findOrCreateRegionPool(region, size);
+        if (poolData == nullptr)
+        {
+            return nullptr;
+        }
+    }
+
+    Slab_t *slab = poolData->partialSlabs;
+    if (slab == nullptr || slab->nextFreeBlockInSequence == slab->totalBlocks)
+    {
+        slab = nextRegionSlab(poolData);
+        if (slab == nullptr)
+        {
+            poolData->failedAllocations++;
+            return nullptr;
+        }
+    }
+    return findAddressFromBlock(slab->nextFreeBlockInSequence++, slab);
+}
+
+/* Serves SM_alloc. Counts the allocation in the counters of its size class. */
+static inline void *allocBlock(size_t size)
+{
+    //printf("SM_alloc called for %d bytes\n", size);
+
+    if (size <= SM_MAX_SMALL_SIZE)
+    {
+        return allocFromMagazine(m_SizeClasses.index[(size + SM_SIZE_CLASS_QUANTUM - 1) >> SM_SIZE_CLASS_QUANTUM_SHIFT], size);
+    }
+
+    if (size > UINT_MAX || SM_sizeClassSize(size) > UINT_MAX)
+    {
+        printf("ERROR: SM_alloc: %zu bytes is larger than the largest pool!\n", size);
+        return nullptr;
+    }
+
+    /* Find which pool to use. If pool of required size not present, create a pool */
+    PoolData_t *poolData = findOrCreatePool(size);
+
+    pthread_mutex_lock(&poolData->lock);
+    drainRemoteFrees(poolData);
+    void *ptr = allocBlockFromPool(poolData);
+    if (ptr != nullptr)
+    {
+        poolData->requestedBytes += size;
+    }
+    else
+    {
+        poolData->failedAllocations++;
+    }
+    pthread_mutex_unlock(&poolData->lock);
+
+    decayQuietPools();
+    return ptr;
+}
+
+/* Serves an allocation and records how long it took in the latency histogram of its size class */
+static void *allocBlockSampled(size_t size)
+{
+    struct timespec start;
+    struct timespec end;
+
+    t_ThreadCache.sampleTick = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    void *ptr = allocBlock(size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ptr != nullptr)
+    {
+        long long ns = (long long)(end.tv_sec - start.tv_sec) * 1000000000 + (end.tv_nsec - start.tv_nsec);
+        unsigned int bucket = latencyBucket(ns > 0 ? (unsigned long long)ns : 0);
+        PoolData_t *poolData = findSlabFromAddress(ptr)->pool;
+        if (poolData->cacheIndex >= 0)
+        {
+            addThreadCounter(&t_ThreadCache.magazines[poolData->cacheIndex].latency[bucket], 1);
+        }
+        else
+        {
+            poolData->latency[bucket].fetch_add(1, memory_order_relaxed);
+        }
+    }
+    return ptr;
+}
+
+/**
+ * The function `SM_alloc` allocates memory from a pool based on the requested size, either reusing
+ * freed blocks or allocating new blocks.
+ *
+ * @param size The `size` parameter in the `SM_alloc` function represents the size of memory to be
+ * allocated in bytes. This function is responsible for allocating memory from a memory pool based on
+ * the specified size. If a pool of the required size is not present, it creates a new pool. If the
+ * pool has no free block, a new slab is chained to it. Blocks of pools in m_PoolTable are taken from
+ * the calling thread's magazine without locking. With SM_setLatencySampling, every Nth call of a
+ * thread is timed. Between SM_region_begin and SM_region_end, the block comes from the region.
+ *
+ * @return The function `SM_alloc` is returning a pointer of type `void` which points to the allocated
+ * memory block, or nullptr if the pool cannot grow any more.
+ */
+void * SM_alloc(size_t size)
+{
+    unsigned int interval = m_LatencySampleInterval.load(memory_order_relaxed);
+    SM_Region_t *region = t_Region;
+    void *ptr;
+    if (region != nullptr)
+    {
+        ptr = allocFromRegion(region, size);
+    }
+    else if (interval != 0 && ++t_ThreadCache.sampleTick >= interval)
+    {
+        ptr = allocBlockSampled(size);
+    }
+    else
+    {
+        ptr = allocBlock(size);
+    }
+
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        SM_traceAlloc(ptr, size);
+    }
+    return ptr;
+}
+
+void SM_dealloc(void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        SM_traceFree(ptr);
+    }
+
+    /* Find the slab in which this address lies. */
+    Slab_t *slab = findSlabOfBlock(ptr);
+    PoolData_t *poolData = slab->pool;
+    //printf("Deallocating %p from pool %u\n", ptr, poolData->poolSize);
+
+    if (poolData->cacheIndex >= 0)
+    {
+        freeToMagazine(poolData, ptr);
+        return;
+    }
+
+    /* Region blocks are released all at once by SM_region_reset */
+    if (poolData->region != nullptr)
+    {
+        return;
+    }
+
+    poolData->frees.fetch_add(1, memory_order_relaxed);
+    pushRemoteFrees(poolData, linkOfBlock(poolData, ptr), linkOfBlock(poolData, ptr));
+}
+
+/**
+ * The function `SM_alloc_class` allocates a block of the small size class `sizeClass`, which the
+ * caller computed at compile time with SM_sizeClassIndex. It skips the size to class lookup of
+ * SM_alloc. Used by SM_Allocator.
+ *
+ * @param sizeClass Size class index, below SM_SIZE_CLASS_COUNT.
+ * @param size Requested size in bytes, only used for the statistics.
+ *
+ * @return The allocated block, or nullptr if the pool cannot grow any more.
+ */
+void *SM_alloc_class(unsigned int sizeClass, size_t size)
+{
+    unsigned int interval = m_LatencySampleInterval.load(memory_order_relaxed);
+    void *ptr;
+    if (interval != 0 && ++t_ThreadCache.sampleTick >= interval)
+    {
+        ptr = allocBlockSampled(size);
+    }
+    else
+    {
+        ptr = allocFromMagazine(sizeClass, size);
+    }
+
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        SM_traceAlloc(ptr, size);
+    }
+    return ptr;
+}
+
+/**
+ * The function `SM_dealloc_class` frees a block of the small size class `sizeClass`. As the pool is
+ * known, the slab directory is not consulted. The block must have been allocated with this class.
+ */
+void SM_dealloc_class(void *ptr, unsigned int sizeClass)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        SM_traceFree(ptr);
+    }
+
+    PoolData_t *poolData = m_PoolTable[sizeClass].load(memory_order_acquire);
+    freeToMagazine(poolData, ptr);
+}
+
+/**
+ * The function `SM_alloc_batch` allocates count blocks of size bytes with a single pool lookup, lock
+ * acquisition and counter update.
+ *
+ * @param size The `size` parameter is the size in bytes of every block.
+ * @param count The `count` parameter is the number of blocks to allocate.
+ * @param out The `out` parameter is an array of at least `count` pointers which receives the blocks.
+ * As far as the pool allows, the blocks are consecutive in memory and in ascending address order.
+ *
+ * @return The function `SM_alloc_batch` returns the number of blocks stored in `out`. It is less than
+ * `count` only if the pool cannot grow any more.
+ */
+unsigned int SM_alloc_batch(size_t size, unsigned int count, void **out)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (size > UINT_MAX || SM_sizeClassSize(size) > UINT_MAX)
+    {
+        printf("ERROR: SM_alloc_batch: %zu bytes is larger than the largest pool!\n", size);
+        return 0;
+    }
+
+    PoolData_t *poolData = findOrCreatePool(size);
+
+    pthread_mutex_lock(&poolData->lock);
+    drainRemoteFrees(poolData);
+    unsigned int allocated = allocBlocksFromPool(poolData, count, out);
+    if (poolData->cacheIndex < 0)
+    {
+        poolData->requestedBytes += (unsigned long long)size * allocated;
+        poolData->failedAllocations += count - allocated;
+    }
+    pthread_mutex_unlock(&poolData->lock);
+
+    if (poolData->cacheIndex >= 0)
+    {
+        if (!t_ThreadCache.isRegistered)
+        {
+            registerThreadCache();
+        }
+        Magazine_t *magazine = &t_ThreadCache.magazines[poolData->cacheIndex];
+        addThreadCounter(&magazine->allocations, allocated);
+        addThreadCounter(&magazine->requestedBytes, (unsigned long long)size * allocated);
+        addThreadCounter(&magazine->failedAllocations, count - allocated);
+    }
+
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        for (unsigned int i = 0; i < allocated; i++)
+        {
+            SM_traceAlloc(out[i], size);
+        }
+    }
+    return allocated;
+}
+
+/* Splices a chain of count blocks of one pool onto its remote free list and counts the frees */
+static void freeChain(PoolData_t *poolData, FreeBlock_t *first, FreeBlock_t *last, unsigned int count)
+{
+    if (poolData->cacheIndex >= 0)
+    {
+        if (!t_ThreadCache.isRegistered)
+        {
+            registerThreadCache();
+        }
+        addThreadCounter(&t_ThreadCache.magazines[poolData->cacheIndex].frees, count);
+    }
+    else
+    {
+        poolData->frees.fetch_add(count, memory_order_relaxed);
+    }
+    pushRemoteFrees(poolData, first, last);
+}
+
+/**
+ * The function `SM_dealloc_batch` frees count blocks. Each run of consecutive pointers belonging to the
+ * same pool is linked into one chain and spliced onto the pool's free list in one operation, so a batch
+ * from SM_alloc_batch costs a single atomic update.
+ *
+ * @param ptrs The `ptrs` parameter is the array of blocks to free. nullptr entries are skipped.
+ * @param count The `count` parameter is the number of entries in `ptrs`.
+ */
+void SM_dealloc_batch(void **ptrs, unsigned int count)
+{
+    PoolData_t *poolData = nullptr;
+    FreeBlock_t *first = nullptr;
+    FreeBlock_t *last = nullptr;
+    unsigned int chained = 0;
+    bool isTracing = m_IsTracing.load(memory_order_relaxed);
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (ptrs[i] == nullptr)
+        {
+            continue;
+        }
+        if (isTracing)
+        {
+            SM_traceFree(ptrs[i]);
+        }
+
+        PoolData_t *blockPool = findSlabOfBlock(ptrs[i])->pool;
+        if (blockPool->region != nullptr)
+        {
+            continue;
+        }
+        FreeBlock_t *block = linkOfBlock(blockPool, ptrs[i]);
+        if (blockPool != poolData)
+        {
+            if (first != nullptr)
+            {
+                freeChain(poolData, first, last, chained);
+            }
+            poolData = blockPool;
+            first = block;
+            chained = 0;
+        }
+        else
+        {
+            last->next = block;
+        }
+        last = block;
+        chained++;
+    }
+
+    if (first != nullptr)
+    {
+        freeChain(poolData, first, last, chained);
+    }
+}
+
+/**
+ * The function `SM_cache_create` creates a named cache of objects of `objectSize` bytes. The
+ * constructor runs on every object when its slab is populated, not on every allocation, and the
+ * destructor when the slab is given back. Both run with the cache locked and must not use the cache.
+ *
+ * @param name Unique name of the cache, at most SM_OBJECT_CACHE_NAME_SIZE - 1 characters.
+ * @param objectSize Size of an object in bytes.
+ * @param alignment Alignment of the objects, a power of two up to SM_REGION_SIZE. 0 for pointer alignment.
+ * @param constructor Function constructing an object, or nullptr.
+ * @param destructor Function destroying an object, or nullptr.
+ *
+ * @return The cache, or nullptr if the arguments are invalid or the name is taken.
+ */
+SM_ObjectCache_t *SM_cache_create(const char *name, size_t objectSize, size_t alignment,
+                                  SM_ObjectFunction_t constructor, SM_ObjectFunction_t destructor)
+{
+    if (alignment < alignof(FreeBlock_t))
+    {
+        alignment = alignof(FreeBlock_t);
+    }
+    if (name == nullptr || strlen(name) >= SM_OBJECT_CACHE_NAME_SIZE || objectSize == 0 || objectSize > UINT_MAX / 2 ||
+        (alignment & (alignment - 1)) != 0 || alignment > SM_REGION_SIZE)
+    {
+        printf("ERROR: SM_cache_create: Invalid object cache %s!\n", name != nullptr ? name : "(null)");
+        return nullptr;
+    }
+
+    /* Without a constructor there is no state to keep, so the link can overlay the object */
+    size_t linkOffset = 0;
+    if (constructor != nullptr)
+    {
+        linkOffset = (objectSize + alignof(FreeBlock_t) - 1) & ~(alignof(FreeBlock_t) - 1);
+    }
+    size_t blockSize = linkOffset + sizeof(FreeBlock_t) > objectSize ? linkOffset + sizeof(FreeBlock_t) : objectSize;
+    blockSize = (blockSize + alignment - 1) & ~(alignment - 1);
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (SM_ObjectCache_t *cache = m_ObjectCacheList; cache != nullptr; cache = cache->next)
+    {
+        if (strcmp(cache->name, name) == 0)
+        {
+            pthread_mutex_unlock(&m_PoolMapLock);
+            printf("ERROR: SM_cache_create: Object cache %s already exists!\n", name);
+            return nullptr;
+        }
+    }
+
+    SM_ObjectCache_t *cache = (SM_ObjectCache_t *)malloc(sizeof(SM_ObjectCache_t));
+    PoolData_t *poolData = cache != nullptr ? allocPoolData() : nullptr;
+    if (poolData == nullptr)
+    {
+        pthread_mutex_unlock(&m_PoolMapLock);
+        printf("\n\n**MEMORY ERROR: SM_cache_create: Failed to create object cache %s!!\n\n", name);
+        free(cache);
+        return nullptr;
+    }
+
+    resetPoolData((unsigned int)objectSize, poolData);
+    poolData->blockSize = (unsigned int)blockSize;
+    poolData->alignment = (unsigned int)alignment;
+    poolData->linkOffset = (unsigned int)linkOffset;
+    poolData->constructor = constructor;
+    poolData->destructor = destructor;
+    poolData->nextSlabBlocks = 1;   // The first slab is one region. Later slabs grow with growthFactor.
+
+    strcpy(cache->name, name);
+    cache->pool = poolData;
+    cache->next = m_ObjectCacheList;
+    m_ObjectCacheList = cache;
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    return cache;
+}
+
+/**
+ * The function `SM_cache_find` returns the object cache called `name`, or nullptr if there is none.
+ */
+SM_ObjectCache_t *SM_cache_find(const char *name)
+{
+    SM_ObjectCache_t *cache = nullptr;
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (cache = m_ObjectCacheList; cache != nullptr; cache = cache->next)
+    {
+        if (strcmp(cache->name, name) == 0)
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+    return cache;
+}
+
+/**
+ * The function `SM_cache_alloc` returns a constructed object of a cache.
+ *
+ * @return The object, or nullptr if the cache cannot grow any more.
+ */
+void *SM_cache_alloc(SM_ObjectCache_t *cache)
+{
+    PoolData_t *poolData = cache->pool;
+
+    pthread_mutex_lock(&poolData->lock);
+    drainRemoteFrees(poolData);
+    void *object = allocBlockFromPool(poolData);
+    if (object == nullptr)
+    {
+        poolData->failedAllocations++;
+    }
+    pthread_mutex_unlock(&poolData->lock);
+
+    return object;
+}
+
+/**
+ * The function `SM_cache_free` gives an object back to its cache. The object must be in its
+ * constructed state, as it is handed out again without running the constructor. SM_dealloc can be
+ * used as well, in which case the object goes back through the remote free list.
+ */
+void SM_cache_free(SM_ObjectCache_t *cache, void *object)
+{
+    if (object == nullptr)
+    {
+        return;
+    }
+
+    PoolData_t *poolData = cache->pool;
+    poolData->frees.fetch_add(1, memory_order_relaxed);
+
+    pthread_mutex_lock(&poolData->lock);
+    deallocBlockToPool(findSlabOfBlock(object), object);
+    pthread_mutex_unlock(&poolData->lock);
+}
+
+/**
+ * The function `SM_cache_destroy` destroys every object of a cache, including the ones still in use,
+ * and releases the cache. No thread may use the cache while or after it runs.
+ */
+void SM_cache_destroy(SM_ObjectCache_t *cache)
+{
+    pthread_mutex_lock(&m_PoolMapLock);
+    SM_ObjectCache_t **link = &m_ObjectCacheList;
+    while (*link != nullptr && *link != cache)
+    {
+        link = &(*link)->next;
+    }
+    if (*link == cache)
+    {
+        *link = cache->next;
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    destroyObjectCache(cache);
+}
+
+/**
+ * The function `SM_region_create` creates an empty region. Its pools and slabs are created by the
+ * first allocations of each size class.
+ *
+ * @return The region, or nullptr if it cannot be allocated.
+ */
+SM_Region_t *SM_region_create()
+{
+    SM_Region_t *region = (SM_Region_t *)malloc(sizeof(SM_Region_t));
+    if (region == nullptr)
+    {
+        printf("\n\n**MEMORY ERROR: SM_region_create: Failed to create region!!\n\n");
+        return nullptr;
+    }
+    new (region) SM_Region_t();
+    region->previous = nullptr;
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    region->next = m_RegionList;
+    m_RegionList = region;
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    return region;
+}
+
+/**
+ * The function `SM_region_begin` routes SM_alloc of the calling thread to `region` until the matching
+ * SM_region_end. Regions can be nested; SM_region_end goes back to the region used before.
+ */
+void SM_region_begin(SM_Region_t *region)
+{
+    region->previous = t_Region;
+    t_Region = region;
+}
+
+/**
+ * The function `SM_region_end` stops routing SM_alloc of the calling thread to `region`, which must
+ * be the region of the innermost SM_region_begin of this thread. Its blocks stay valid until the next
+ * SM_region_reset or SM_region_destroy.
+ */
+void SM_region_end(SM_Region_t *region)
+{
+    if (t_Region != region)
+    {
+        printf("ERROR: SM_region_end: Region %p is not the current region of this thread!\n", (void *)region);
+        return;
+    }
+    t_Region = region->previous;
+    region->previous = nullptr;
+}
+
+/**
+ * The function `SM_region_alloc` allocates a block of `size` bytes from `region` whether or not it is
+ * the current region of the calling thread.
+ *
+ * @return The block, or nullptr if the region cannot grow any more.
+ */
+void *SM_region_alloc(SM_Region_t *region, size_t size)
+{
+    void *ptr = allocFromRegion(region, size);
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        SM_traceAlloc(ptr, size);
+    }
+    return ptr;
+}
+
+/* Rewinds every slab of a region pool and moves it to the empty list. The memory is kept for the
+ * blocks of the next request. */
+static void resetRegionPool(PoolData_t *poolData)
+{
+    Slab_t **lists[] = { &poolData->partialSlabs, &poolData->fullSlabs };
+    unsigned int usedBlocks = 0;
+
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++)
+    {
+        while (*lists[i] != nullptr)
+        {
+            Slab_t *slab = *lists[i];
+            usedBlocks += slab->nextFreeBlockInSequence;
+            unlinkSlab(lists[i], slab);
+            slab->nextFreeBlockInSequence = 0;
+            slab->freeList = nullptr;
+            slab->usedBlocks = 0;
+            pushSlab(&poolData->emptySlabs, slab);
+        }
+    }
+
+    if (usedBlocks > poolData->highWaterBlocks)
+    {
+        poolData->highWaterBlocks = usedBlocks;
+    }
+    poolData->totalAllocationsFromThisPool += usedBlocks;
+}
+
+/**
+ * The function `SM_region_reset` releases every block of `region` at once. The cost depends on the
+ * number of slabs, not of blocks. The slabs are kept, so the next request of a similar size does not
+ * add any. No block of the region may be used afterwards.
+ */
+void SM_region_reset(SM_Region_t *region)
+{
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        if (region->pools[i] != nullptr)
+        {
+            resetRegionPool(region->pools[i]);
+        }
+    }
+    for (size_t i = 0; i < region->largePools.size(); i++)
+    {
+        resetRegionPool(region->largePools[i]);
+    }
+}
+
+/**
+ * The function `SM_region_destroy` releases every block of `region` and returns its slabs to the OS.
+ * The region must not be current on any thread.
+ */
+void SM_region_destroy(SM_Region_t *region)
+{
+    if (t_Region == region)
+    {
+        SM_region_end(region);
+    }
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    SM_Region_t **link = &m_RegionList;
+    while (*link != nullptr && *link != region)
+    {
+        link = &(*link)->next;
+    }
+    if (*link == region)
+    {
+        *link = region->next;
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    destroyRegion(region);
+}
+
+/* A snapshot file holds a SnapshotHeader_t, a SnapshotPool_t per pool, a SnapshotSlab_t per slab of
+ * these pools in pool order, the bitmaps of the slabs of address ordered pools, and the memory of
+ * every slab at its dataOffset. Each slab gets slabSize
+ * bytes of the file at a multiple of SM_REGION_SIZE, so it can be mapped back with one mmap. Only the
+ * pages up to the last block the slab ever handed out are written; the rest of its bytes are a hole
+ * in the file and read back as zeroes, like fresh slab memory. */
+#define SM_SNAPSHOT_MAGIC               "SMSNAP02"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE             0x100000    // Older kernels ignore it; the address is checked anyway
+#endif
+
+typedef struct SnapshotHeader_tag
+{
+    char magic[8];                               // SM_SNAPSHOT_MAGIC
+    uint32_t regionSize;                         // SM_REGION_SIZE of the saving process
+    uint32_t poolCount;                          // SnapshotPool_t records following the header
+    uint64_t slabCount;                          // SnapshotSlab_t records following the pools
+    uint32_t initialPoolSize;                    // m_initialPoolSize
+    uint32_t nextPoolColor;                      // m_NextPoolColor
+    uint64_t root;                               // Pointer passed to SM_saveSnapshot
+}SnapshotHeader_t;
+
+typedef struct SnapshotPool_tag
+{
+    uint32_t poolSize;
+    uint32_t blockSize;
+    uint32_t alignment;
+    uint32_t nextColor;
+    uint32_t nextSlabBlocks;
+    uint32_t highWaterBlocks;
+    uint32_t totalAllocationsFromThisPool;
+    uint32_t slabCount;                          // Slabs of this pool, following the slabs of the previous pool
+    uint32_t isAddressOrdered;
+    uint32_t reserved;
+    uint64_t failedAllocations;
+    uint64_t requestedBytes;
+    uint64_t frees;
+}SnapshotPool_t;
+
+typedef struct SnapshotSlab_tag
+{
+    uint64_t baseAddress;                        // Address the slab is mapped back at
+    uint64_t startOffset;                        // startAddress - baseAddress
+    uint64_t slabSize;
+    uint64_t freeList;
+    uint64_t dataOffset;                         // Offset of the slab memory in the file
+    uint64_t dataSize;                           // Bytes of the slab memory written, a multiple of the page size
+    uint64_t bitmapOffset;                       // Offset of the bitmap in the file. 0 if the slab has none.
+    uint32_t totalBlocks;
+    uint32_t usedBlocks;
+    uint32_t nextFreeBlockInSequence;
+    uint32_t isPurged;
+}SnapshotSlab_t;
+
+static bool writeAll(int fd, const void *buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = pwrite(fd, buffer, size, offset);
+        if (written <= 0)
+        {
+            return false;
+        }
+        buffer = (const char *)buffer + written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void *buffer, size_t size, off_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t bytes = pread(fd, buffer, size, offset);
+        if (bytes <= 0)
+        {
+            return false;
+        }
+        buffer = (char *)buffer + bytes;
+        size -= bytes;
+        offset += bytes;
+    }
+    return true;
+}
+
+/* Appends the slabs of a list to the snapshot records, in list order */
+static void addSnapshotSlabs(Slab_t *slab, vector<Slab_t*> *slabs)
+{
+    for (; slab != nullptr; slab = slab->next)
+    {
+        slabs->push_back(slab);
+    }
+}
+
+/**
+ * The function `SM_saveSnapshot` writes the slabs and pool metadata of every pool to `path`, so that
+ * a restarted process can map them back with SM_loadSnapshot instead of rebuilding its pooled data.
+ * All pools are locked while the snapshot is written, so it is consistent. The file is written next
+ * to `path` and renamed over it when complete.
+ *
+ * Blocks cached by the calling thread are given back first. Blocks cached by other threads are saved
+ * as used and are lost after a restore, so save when the other threads are idle. Object caches are
+ * not saved.
+ *
+ * @param path File to write.
+ * @param root Pointer returned by SM_loadSnapshot, typically the root of the pooled data structure.
+ *
+ * @return false if the file cannot be written.
+ */
+bool SM_saveSnapshot(const char *path, void *root)
+{
+    flushThreadCache();
+
+    string temporaryPath = string(path) + ".tmp";
+    int fd = open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+    {
+        printf("ERROR: SM_saveSnapshot: Cannot write %s!\n", temporaryPath.c_str());
+        return false;
+    }
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    vector<SnapshotPool_t> pools;
+    vector<Slab_t*> slabs;
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        PoolData_t *poolData = it->second;
+        pthread_mutex_lock(&poolData->lock);
+        drainRemoteFrees(poolData);
+
+        SnapshotPool_t pool;
+        memset(&pool, 0, sizeof(pool));
+        pool.poolSize = poolData->poolSize;
+        pool.blockSize = poolData->blockSize;
+        pool.alignment = poolData->alignment;
+        pool.nextColor = poolData->nextColor;
+        pool.nextSlabBlocks = poolData->nextSlabBlocks;
+        pool.highWaterBlocks = poolData->highWaterBlocks;
+        pool.totalAllocationsFromThisPool = poolData->totalAllocationsFromThisPool;
+        pool.failedAllocations = poolData->failedAllocations;
+        pool.requestedBytes = poolData->requestedBytes;
+        pool.frees = poolData->frees.load(memory_order_relaxed);
+        pool.isAddressOrdered = poolData->isAddressOrdered;
+
+        size_t firstSlab = slabs.size();
+        addSnapshotSlabs(poolData->partialSlabs, &slabs);
+        addSnapshotSlabs(poolData->emptySlabs, &slabs);
+        addSnapshotSlabs(poolData->fullSlabs, &slabs);
+        pool.slabCount = (uint32_t)(slabs.size() - firstSlab);
+        pools.push_back(pool);
+    }
+
+    SnapshotHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SM_SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.regionSize = SM_REGION_SIZE;
+    header.poolCount = (uint32_t)pools.size();
+    header.slabCount = slabs.size();
+    header.initialPoolSize = m_initialPoolSize;
+    header.nextPoolColor = m_NextPoolColor;
+    header.root = (uint64_t)(uintptr_t)root;
+
+    size_t metadataSize = sizeof(header) + pools.size() * sizeof(SnapshotPool_t) + slabs.size() * sizeof(SnapshotSlab_t);
+    size_t bitmapOffset = metadataSize;
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        if (slabs[i]->bitmap != nullptr)
+        {
+            metadataSize += bitmapWords(slabs[i]->totalBlocks) * sizeof(uint64_t);
+        }
+    }
+    off_t dataOffset = (off_t)((metadataSize + SM_REGION_SIZE - 1) & ~(SM_REGION_SIZE - 1));
+    vector<SnapshotSlab_t> slabRecords(slabs.size());
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        Slab_t *slab = slabs[i];
+        SnapshotSlab_t *record = &slabRecords[i];
+        memset(record, 0, sizeof(*record));
+        record->baseAddress = (uint64_t)(uintptr_t)slab->baseAddress;
+        record->startOffset = slab->startAddress - slab->baseAddress;
+        record->slabSize = slab->slabSize;
+        record->freeList = (uint64_t)(uintptr_t)slab->freeList;
+        record->dataOffset = (uint64_t)dataOffset;
+        record->totalBlocks = slab->totalBlocks;
+        record->usedBlocks = slab->usedBlocks;
+        record->nextFreeBlockInSequence = slab->nextFreeBlockInSequence;
+        record->isPurged = slab->isPurged;
+        if (slab->bitmap != nullptr)
+        {
+            record->bitmapOffset = bitmapOffset;
+            bitmapOffset += bitmapWords(slab->totalBlocks) * sizeof(uint64_t);
+        }
+        if (!slab->isPurged)
+        {
+            size_t handedOut = findAddressFromBlock(slab->nextFreeBlockInSequence, slab) - slab->baseAddress;
+            record->dataSize = (handedOut + pageSize - 1) & ~(pageSize - 1);
+            if (record->dataSize > slab->slabSize)
+            {
+                record->dataSize = slab->slabSize;
+            }
+        }
+        dataOffset += (off_t)slab->slabSize;
+    }
+
+    bool isWritten = writeAll(fd, &header, sizeof(header), 0) &&
+                     writeAll(fd, pools.data(), pools.size() * sizeof(SnapshotPool_t), sizeof(header)) &&
+                     writeAll(fd, slabRecords.data(), slabRecords.size() * sizeof(SnapshotSlab_t),
+                              sizeof(header) + pools.size() * sizeof(SnapshotPool_t));
+    for (size_t i = 0; isWritten && i < slabs.size(); i++)
+    {
+        if (slabs[i]->bitmap != nullptr)
+        {
+            isWritten = writeAll(fd, slabs[i]->bitmap, bitmapWords(slabs[i]->totalBlocks) * sizeof(uint64_t),
+                                 (off_t)slabRecords[i].bitmapOffset);
+        }
+        isWritten = isWritten && writeAll(fd, slabs[i]->baseAddress, slabRecords[i].dataSize, (off_t)slabRecords[i].dataOffset);
+    }
+
+    for (map<unsigned int, PoolData_t*>::iterator it = m_PoolMap.begin(); it != m_PoolMap.end(); it++)
+    {
+        pthread_mutex_unlock(&it->second->lock);
+    }
+    pthread_mutex_unlock(&m_PoolMapLock);
+
+    isWritten = isWritten && ftruncate(fd, dataOffset) == 0 && fsync(fd) == 0;
+    isWritten = close(fd) == 0 && isWritten;
+    if (!isWritten || rename(temporaryPath.c_str(), path) != 0)
+    {
+        printf("ERROR: SM_saveSnapshot: Cannot write %s!\n", path);
+        unlink(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+/* Maps a saved slab back at its address and adds it to poolData. The caller holds m_PoolMapLock. */
+static bool restoreSlab(int fd, PoolData_t *poolData, const SnapshotSlab_t *record)
+{
+    char *baseAddress = (char *)(uintptr_t)record->baseAddress;
+    if (poolData->isAddressOrdered != (record->bitmapOffset != 0))
+    {
+        printf("ERROR: SM_loadSnapshot: The bitmap of a slab of pool %u is missing!\n", poolData->poolSize);
+        return false;
+    }
+    Slab_t *slab = allocSlabData(poolData, record->totalBlocks);
+    if (slab != nullptr && slab->bitmap != nullptr &&
+        !readAll(fd, slab->bitmap, bitmapWords(record->totalBlocks) * sizeof(uint64_t), (off_t)record->bitmapOffset))
+    {
+        free(slab);
+        return false;
+    }
+    void *ptr = slab != nullptr ? mmap(baseAddress, record->slabSize, PROT_READ | PROT_WRITE,
+                                       MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, (off_t)record->dataOffset) : MAP_FAILED;
+    if (ptr != baseAddress)
+    {
+        printf("ERROR: SM_loadSnapshot: Cannot map a slab of pool %u back at %p!\n", poolData->poolSize, baseAddress);
+        if (ptr != MAP_FAILED)
+        {
+            munmap(ptr, record->slabSize);
+        }
+        free(slab);
+        return false;
+    }
+    if (!registerSlab(baseAddress, record->slabSize, slab))
+    {
+        unregisterSlab(baseAddress, record->slabSize);
+        munmap(ptr, record->slabSize);
+        free(slab);
+        return false;
+    }
+
+    slab->pool = poolData;
+    slab->baseAddress = baseAddress;
+    slab->startAddress = baseAddress + record->startOffset;
+    slab->endAddress = slab->startAddress + (size_t)record->totalBlocks * poolData->blockSize;
+    slab->slabSize = record->slabSize;
+    slab->totalBlocks = record->totalBlocks;
+    slab->usedBlocks = record->usedBlocks;
+    slab->nextFreeBlockInSequence = record->nextFreeBlockInSequence;
+    slab->freeList = (FreeBlock_t *)(uintptr_t)record->freeList;
+    slab->emptySince = nowMilliseconds();
+    slab->isPurged = record->isPurged != 0;
+    linkSlab(poolData, slabListFor(poolData, slab, slab->usedBlocks), slab);
+
+    poolData->totalSize += slab->slabSize;
+    /* As on the allocation path, every used block takes poolSize bytes off the remaining space */
+    poolData->remainingSpace += (slab->endAddress - slab->startAddress) - (size_t)slab->usedBlocks * poolData->poolSize;
+    poolData->totalBlocks += slab->totalBlocks;
+    poolData->freeBlocks += slab->totalBlocks - slab->usedBlocks;
+    poolData->usedBlocks += slab->usedBlocks;
+    poolData->slabCount++;
+    return true;
+}
+
+/* Checks that the records of a snapshot describe pools this build can serve */
+static bool isValidSnapshot(const SnapshotHeader_t *header, const vector<SnapshotPool_t> &pools,
+                            const vector<SnapshotSlab_t> &slabs)
+{
+    uint64_t slabCount = 0;
+    for (size_t i = 0; i < pools.size(); i++)
+    {
+        const SnapshotPool_t *pool = &pools[i];
+        if (SM_sizeClassSize(pool->poolSize) != pool->poolSize || pool->blockSize < sizeof(FreeBlock_t) ||
+            pool->blockSize % pool->alignment != 0 || (i > 0 && pools[i - 1].poolSize >= pool->poolSize))
+        {
+            return false;
+        }
+        slabCount += pool->slabCount;
+    }
+    for (size_t i = 0; i < slabs.size(); i++)
+    {
+        const SnapshotSlab_t *slab = &slabs[i];
+        if (slab->baseAddress % SM_REGION_SIZE != 0 || slab->slabSize % SM_REGION_SIZE != 0 ||
+            slab->dataOffset % SM_REGION_SIZE != 0 || slab->bitmapOffset % sizeof(uint64_t) != 0 ||
+            slab->usedBlocks > slab->totalBlocks ||
+            slab->nextFreeBlockInSequence > slab->totalBlocks)
+        {
+            return false;
+        }
+    }
+    return header->regionSize == SM_REGION_SIZE && slabCount == header->slabCount;
+}
+
+/**
+ * The function `SM_loadSnapshot` restores the pools saved by SM_saveSnapshot. Every slab is mapped
+ * back privately from the file at the address it had when it was saved, so pointers between pooled
+ * blocks stay valid and pages are only read from the file when they are first touched. Writes go to
+ * private copies and never reach the file. It replaces initStorageManager and must be called before
+ * any allocation, as early as possible so that nothing else occupies the addresses of the slabs.
+ * Requires SM_BACKING_MMAP.
+ *
+ * @param path File written by SM_saveSnapshot.
+ * @param root Receives the root pointer passed to SM_saveSnapshot.
+ *
+ * @return false if the snapshot cannot be restored. The storage manager is then left empty.
+ */
+bool SM_loadSnapshot(const char *path, void **root)
+{
+    if (m_Config.backing != SM_BACKING_MMAP)
+    {
+        printf("ERROR: SM_loadSnapshot: Snapshots are restored into SM_BACKING_MMAP pools only!\n");
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("ERROR: SM_loadSnapshot: Cannot read %s!\n", path);
+        return false;
+    }
+
+    SnapshotHeader_t header;
+    vector<SnapshotPool_t> pools;
+    vector<SnapshotSlab_t> slabs;
+    bool isValid = readAll(fd, &header, sizeof(header), 0) && memcmp(header.magic, SM_SNAPSHOT_MAGIC, sizeof(header.magic)) == 0;
+    if (isValid)
+    {
+        pools.resize(header.poolCount);
+        slabs.resize(header.slabCount);
+        isValid = readAll(fd, pools.data(), pools.size() * sizeof(SnapshotPool_t), sizeof(header)) &&
+                  readAll(fd, slabs.data(), slabs.size() * sizeof(SnapshotSlab_t),
+                          sizeof(header) + pools.size() * sizeof(SnapshotPool_t)) &&
+                  isValidSnapshot(&header, pools, slabs);
+    }
+    if (!isValid)
+    {
+        printf("ERROR: SM_loadSnapshot: %s is not a snapshot of this storage manager!\n", path);
+        close(fd);
+        return false;
+    }
+
+    pthread_mutex_lock(&m_PoolMapLock);
+    if (!m_PoolMap.empty())
+    {
+        pthread_mutex_unlock(&m_PoolMapLock);
+        printf("ERROR: SM_loadSnapshot: The storage manager already has pools!\n");
+        close(fd);
+        return false;
+    }
+
+    m_initialPoolSize = header.initialPoolSize;
+    size_t slab = 0;
+    for (size_t i = 0; i < pools.size() && isValid; i++)
+    {
+        const SnapshotPool_t *pool = &pools[i];
+        PoolData_t *poolData = allocPoolData();
+        if (poolData == nullptr)
+        {
+            isValid = false;
+            break;
+        }
+
+        initializePoolData(pool->poolSize, poolData);
+        poolData->blockSize = pool->blockSize;
+        poolData->alignment = pool->alignment;
+        poolData->nextColor = pool->nextColor;
+        poolData->nextSlabBlocks = pool->nextSlabBlocks;
+        poolData->highWaterBlocks = pool->highWaterBlocks;
+        poolData->totalAllocationsFromThisPool = pool->totalAllocationsFromThisPool;
+        poolData->failedAllocations = pool->failedAllocations;
+        poolData->requestedBytes = pool->requestedBytes;
+        poolData->frees.store(pool->frees, memory_order_relaxed);
+        poolData->isAddressOrdered = pool->isAddressOrdered != 0;
+
+        /* Slabs are pushed on the head of their list, so restore them last first to keep the order */
+        for (size_t j = pool->slabCount; j > 0 && isValid; j--)
+        {
+            isValid = restoreSlab(fd, poolData, &slabs[slab + j - 1]);
+        }
+        slab += pool->slabCount;
+    }
+    m_NextPoolColor = header.nextPoolColor;
+    pthread_mutex_unlock(&m_PoolMapLock);
+    close(fd);
+
+    if (!isValid)
+    {
+        printf("ERROR: SM_loadSnapshot: Failed to restore %s!\n", path);
+        destroyStorageManager();
+        return false;
+    }
+
+    if (root != nullptr)
+    {
+        *root = (void *)(uintptr_t)header.root;
+    }
+    return true;
+}
+
+/**
+ * The function `findSlabOfBlock` is findSlabFromAddress for the pointers handed to the free functions.
+ * It also aborts if `ptr` is not the start of a block, rather than freeing the block it points into.
+ */
+Slab_t *findSlabOfBlock(void *ptr)
+{
+    Slab_t *slab = findSlabFromAddress(ptr);
+    if ((size_t)((char *)ptr - slab->startAddress) % slab->pool->blockSize != 0)
+    {
+        printf("\n\n**ERROR: %p is not the start of a block of pool %u!!\n\n", ptr, slab->pool->poolSize);
+        abort();
+    }
+    return slab;
+}
+
+unsigned int findPoolFromAddress(void *ptr)
+{
+    return findSlabFromAddress(ptr)->pool->poolSize;
+}
+
+/**
+ * The function `findSlabFromAddress` returns the slab owning `ptr` in constant time from the slab
+ * directory. `ptr` may point anywhere inside a block, as the free list links of object caches do. It
+ * aborts if `ptr` does not lie within the blocks of any slab.
+ */
+Slab_t *findSlabFromAddress(void *ptr)
+{
+    uintptr_t region = (uintptr_t)ptr >> SM_REGION_SHIFT;
+    uintptr_t root = region >> SM_DIRECTORY_LEAF_BITS;
+    Slab_t *slab = nullptr;
+
+    atomic<Slab_t*> *leaf = root < ((uintptr_t)1 << SM_DIRECTORY_ROOT_BITS) ?
+                            m_SlabDirectory[root].load(memory_order_acquire) : nullptr;
+    if (leaf != nullptr)
+    {
+        slab = leaf[region & (((uintptr_t)1 << SM_DIRECTORY_LEAF_BITS) - 1)].load(memory_order_acquire);
+    }
+
+    if (slab == nullptr || (char *)ptr < slab->startAddress || (char *)ptr >= slab->endAddress)
+    {
+        /* If we reached here, it means something is wrong! */
+        printf("\n\n**ERROR: %p not present in any of the memory pools!!\n\n", ptr);
+        abort();
+    }
+    return slab;
 }
 
-char *findAddressFromBlock(unsigned int block, PoolData_t *poolData)
+char *findAddressFromBlock(unsigned int block, Slab_t *slab)
 {
-    return poolData->startAddress + (block * poolData->poolSize);
+    return slab->startAddress + ((size_t)block * slab->pool->blockSize);
 }
 
-unsigned int findBlockFromAddress(char *addr, PoolData_t *poolData)
+unsigned int findBlockFromAddress(char *addr, Slab_t *slab)
 {
-    return (addr - poolData->startAddress) / poolData->poolSize;    
+    return (addr - slab->startAddress) / slab->pool->blockSize;
 }
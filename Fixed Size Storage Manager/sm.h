@@ -1,44 +1,382 @@
 #ifndef SM_H
 #define SM_H
 #include<vector>
-#include<stack>
+#include <pthread.h>
+#include <atomic>
+#include <stdint.h>
 
 using namespace std;
 
-/* These macros should be used to allocate memory */
+/* These macros should be used to allocate memory. Containers can use SM_Allocator and
+ * SM_MemoryResource from sm_allocator.h. */
 #define SM_ALLOC_ARRAY(type, size)      (type *)SM_alloc(size * sizeof(type))
 #define SM_ALLOC(type)                  (type *)SM_alloc(sizeof(type))
 #define SM_DEALLOC(ptr)                 SM_dealloc(ptr)
 
+/* Every request is rounded up to a size class and served by the pool of that class, so the number
+ * of pools stays bounded whatever sizes are requested. The spacing follows jemalloc: classes are
+ * SM_SIZE_CLASS_QUANTUM apart up to SM_SIZE_CLASS_LINEAR_MAX, then every power of two is split into
+ * SM_SIZE_CLASSES_PER_DOUBLING classes. For example with the defaults: 8, 16, ..., 128, 160, 192,
+ * 224, 256, 320, ... Classes up to SM_MAX_SMALL_SIZE are found with one table load and cached in
+ * the per-thread magazines. Larger classes are looked up in the pool map. All four values must be
+ * powers of two and can be overridden at compile time. */
+#ifndef SM_SIZE_CLASS_QUANTUM
+#define SM_SIZE_CLASS_QUANTUM           8
+#endif
+#ifndef SM_SIZE_CLASS_LINEAR_MAX
+#define SM_SIZE_CLASS_LINEAR_MAX        128
+#endif
+#ifndef SM_SIZE_CLASSES_PER_DOUBLING
+#define SM_SIZE_CLASSES_PER_DOUBLING    4
+#endif
+#ifndef SM_MAX_SMALL_SIZE
+#define SM_MAX_SMALL_SIZE               16384
+#endif
+
+constexpr unsigned int SM_log2(size_t value)
+{
+    unsigned int bits = 0;
+    while (value >>= 1)
+    {
+        bits++;
+    }
+    return bits;
+}
+
+/* Returns the size of the class serving requests of size bytes */
+constexpr size_t SM_sizeClassSize(size_t size)
+{
+    if (size <= SM_SIZE_CLASS_QUANTUM)
+    {
+        return SM_SIZE_CLASS_QUANTUM;
+    }
+    if (size <= SM_SIZE_CLASS_LINEAR_MAX)
+    {
+        return (size + SM_SIZE_CLASS_QUANTUM - 1) & ~((size_t)SM_SIZE_CLASS_QUANTUM - 1);
+    }
+    size_t spacing = ((size_t)1 << SM_log2(size - 1)) / SM_SIZE_CLASSES_PER_DOUBLING;
+    return (size + spacing - 1) & ~(spacing - 1);
+}
+
+/* Returns the index of the class serving requests of size bytes. size must not exceed SM_MAX_SMALL_SIZE. */
+constexpr unsigned int SM_sizeClassIndex(size_t size)
+{
+    if (size <= SM_SIZE_CLASS_LINEAR_MAX)
+    {
+        return (unsigned int)(SM_sizeClassSize(size) / SM_SIZE_CLASS_QUANTUM) - 1;
+    }
+    unsigned int group = SM_log2(size - 1);
+    size_t spacing = ((size_t)1 << group) / SM_SIZE_CLASSES_PER_DOUBLING;
+    return SM_SIZE_CLASS_LINEAR_MAX / SM_SIZE_CLASS_QUANTUM - 1 +
+           (group - SM_log2(SM_SIZE_CLASS_LINEAR_MAX)) * SM_SIZE_CLASSES_PER_DOUBLING +
+           (unsigned int)((SM_sizeClassSize(size) - ((size_t)1 << group)) / spacing);
+}
+
+#define SM_SIZE_CLASS_QUANTUM_SHIFT     SM_log2(SM_SIZE_CLASS_QUANTUM)
+#define SM_SIZE_CLASS_COUNT             (SM_sizeClassIndex(SM_MAX_SMALL_SIZE) + 1)
+
+/* Slabs are made of whole regions of 1 << SM_REGION_SHIFT bytes aligned to the region size, so
+ * SM_dealloc finds the slab owning a pointer from the slab directory, a two-level radix table
+ * indexed by the region number of the pointer. */
+#define SM_REGION_SHIFT                 16
+#define SM_REGION_SIZE                  ((size_t)1 << SM_REGION_SHIFT)
+#define SM_ADDRESS_BITS                 48
+#define SM_DIRECTORY_LEAF_BITS          16
+#define SM_DIRECTORY_ROOT_BITS          (SM_ADDRESS_BITS - SM_REGION_SHIFT - SM_DIRECTORY_LEAF_BITS)
+
+/* Every thread caches blocks of the small size classes in a magazine per class. SM_alloc and
+ * SM_dealloc only take the pool lock when a magazine is empty or full, and then move
+ * SM_MAGAZINE_BATCH blocks between the magazine and the pool at once. */
+#define SM_MAGAZINE_SIZE                64
+#define SM_MAGAZINE_BATCH               32
+
+#define SM_CACHE_LINE_SIZE              64
+
+/* Cache coloring gives up at most 1 / SM_COLOR_MAX_OVERHEAD of a slab for start offsets */
+#define SM_COLOR_MAX_OVERHEAD           64
+
+/* Sampled SM_alloc latencies are counted in SM_LATENCY_BUCKETS power of two buckets of nanoseconds.
+ * Bucket i counts latencies in [2^i, 2^(i+1)) ns, bucket 0 also counts 0 ns and the last bucket
+ * everything above. */
+#define SM_LATENCY_BUCKETS              32
+
+/* A freed block stores the link to the next freed block in its first bytes, so
+ * keeping track of free blocks costs no memory outside the pool. */
+typedef struct FreeBlock_tag
+{
+    struct FreeBlock_tag *next;
+}FreeBlock_t;
+
+struct PoolData_tag;
+struct SM_Region_tag;
+
+/* Constructor or destructor of the objects of an object cache */
+typedef void (*SM_ObjectFunction_t)(void *object);
+
+/* A slab is one contiguous chunk of blocks. A pool starts with one slab and chains more
+ * slabs when it runs out of blocks, so live blocks never move. */
+typedef struct Slab_tag
+{
+    struct Slab_tag *next;                       // Next slab in the pool list this slab is on
+    struct Slab_tag *prev;                       // Previous slab in the pool list this slab is on
+    struct PoolData_tag *pool;                   // Pool owning this slab
+    char *baseAddress;                           // Start of the memory of this slab, aligned to SM_REGION_SIZE
+    char *startAddress;                          // Address of the first block. baseAddress plus the color offset.
+    char *endAddress;                            // Ending address of the last block of this slab
+    size_t slabSize;                             // Bytes reserved for this slab from baseAddress. A multiple of SM_REGION_SIZE.
+    unsigned int totalBlocks;                    // Total blocks in this slab
+    unsigned int usedBlocks;                     // Used blocks in this slab
+    unsigned int nextFreeBlockInSequence;        // Next free block in sequence. This is always in order.
+    FreeBlock_t *freeList;                       // Most recently freed block. Freed blocks are linked through their
+                                                 // first bytes and are handed out again (LIFO) before
+                                                 // nextFreeBlockInSequence is used. nullptr if no freed block is available.
+    unsigned long long emptySince;               // Time in milliseconds at which the slab became empty
+    bool isPurged;                               // Pages of this empty slab were given back to the OS
+    unsigned int firstFreeWord;                  // SM_POLICY_LOWEST_ADDRESS: no word of bitmap below this one has a set bit
+    uint64_t *bitmap;                            // SM_POLICY_LOWEST_ADDRESS: bit i is set while block i is free. Stored
+                                                 // right after the Slab_t. freeList is not used and
+                                                 // nextFreeBlockInSequence is one past the highest block handed out.
+                                                 // nullptr under SM_POLICY_LIFO.
+}Slab_t;
+
 typedef struct PoolData_tag
 {
     unsigned int poolSize;                       // Size of this pool
-    char *startAddress;                          // Starting address of this pool
-    char *endAddress;                            // Ending address of this pool
-    unsigned int totalSize;                      // Total size of this pool
-    unsigned int remainingSpace;                 // Remaining size left in this pool
+    unsigned int blockSize;                      // Size of each block. poolSize rounded up to hold a FreeBlock_t
+                                                 // and to a multiple of alignment.
+    unsigned int alignment;                      // Every block is aligned to this power of two
+    unsigned int nextColor;                      // Color of the slab added by the next expandPool
+    size_t totalSize;                            // Total size of all slabs of this pool
+    size_t remainingSpace;                       // Remaining size left in this pool
     unsigned int totalBlocks;                    // Total blocks in this pool
     unsigned int freeBlocks;                     // Free blocks in this pool
     unsigned int usedBlocks;                     // Used blocks in this pool
-    unsigned int nextFreeBlockInSequence;        // Next free block in sequence. This is always in order. 
-    int nextFreeBlock;                          // Next free block available in this pool. This will be allocated 
-                                                // to next alloc request. This can be in between the pool. This can
-                                                // be -ve. If -ve, then memory needs to be allocated from nextFreeBlockInSequence.
-    bool isFreedBlockBlockAvailable;
-    stack<unsigned int> freeBlockStack;   // Stack storing block ID of free blocks
-    unsigned int totalAllocationsFromThisPool;
+    unsigned int slabCount;                      // Number of slabs chained to this pool
+    unsigned int nextSlabBlocks;                 // Blocks in the slab added by the next expandPool
+    Slab_t *partialSlabs;                        // Slabs with used and free blocks. Allocation is served from the head.
+    Slab_t *emptySlabs;                          // Slabs without any used block
+    Slab_t *fullSlabs;                           // Slabs without any free block
+    unsigned int totalAllocationsFromThisPool;   // Blocks handed out by this pool, counting the ones moved to
+                                                 // per-thread magazines
+    unsigned int highWaterBlocks;                // Highest usedBlocks so far
+    unsigned int recentHighWaterBlocks;          // Highest usedBlocks since the last SM_autoTune
+    unsigned long long failedAllocations;        // SM_alloc calls this pool could not serve. Only counted for pools
+                                                 // which are not cached. See Magazine_t for cached pools.
+    unsigned long long requestedBytes;           // Bytes requested from this pool by SM_alloc. Only counted for
+                                                 // pools which are not cached. See Magazine_t for cached pools.
+    int cacheIndex;                              // Size class index of this pool. -1 for classes above SM_MAX_SMALL_SIZE
+                                                 // and object caches.
+    unsigned int linkOffset;                     // Offset of the FreeBlock_t link in a free block. Object caches keep it
+                                                 // after the object so free objects stay constructed.
+    SM_ObjectFunction_t constructor;             // Object caches: run on every block when a slab is populated
+    SM_ObjectFunction_t destructor;              // Object caches: run on every block before a slab's memory goes away
+    struct SM_Region_tag *region;                // Region owning this pool. nullptr for the other pools.
+    bool isAddressOrdered;                       // Slabs have a bitmap and the lowest free block is handed out first.
+                                                 // The partial and empty slab lists are kept in address order.
+    pthread_mutex_t lock;                        // Protects the slabs and counters of this pool
+    alignas(SM_CACHE_LINE_SIZE)
+    atomic<FreeBlock_t*> remoteFreeList;         // Blocks freed without taking the lock. Pushed with a CAS by any
+                                                 // thread and drained as a whole by the next thread refilling
+                                                 // from this pool. These blocks still count as used.
+    atomic<unsigned long long> frees;            // SM_dealloc calls of pools which are not cached
+    atomic<unsigned long long> latency[SM_LATENCY_BUCKETS];  // Sampled SM_alloc latencies of pools which are not cached
 
 }PoolData_t;
 
+typedef struct Magazine_tag
+{
+    unsigned int count;                          // Number of cached blocks
+    void *blocks[SM_MAGAZINE_SIZE];              // Cached blocks. The most recently freed block is on top.
+    atomic<unsigned long long> allocations;      // SM_alloc calls served by this magazine. Only the owning
+    atomic<unsigned long long> requestedBytes;   // thread writes them. Other threads read them for reports.
+    atomic<unsigned long long> frees;            // SM_dealloc calls of this class made by the owning thread
+    atomic<unsigned long long> failedAllocations;// SM_alloc calls of this class which returned nullptr
+    atomic<unsigned long long> latency[SM_LATENCY_BUCKETS];  // Sampled SM_alloc latencies of this class
+}Magazine_t;
+
+typedef struct ThreadCache_tag
+{
+    bool isRegistered;                           // Set once the cache is flushed on thread exit
+    struct ThreadCache_tag *next;                // Next cache in the list of live thread caches
+    struct ThreadCache_tag *prev;                // Previous cache in the list of live thread caches
+    unsigned int sampleTick;                     // SM_alloc calls since the last latency sample
+    Magazine_t magazines[SM_SIZE_CLASS_COUNT];   // Magazine of each small size class
+}ThreadCache_t;
+
+/* Internal fragmentation of one size class */
+typedef struct SM_SizeClassWaste_tag
+{
+    size_t classSize;                            // Block size of the class
+    unsigned long long allocations;              // SM_alloc calls served by the class
+    unsigned long long requestedBytes;           // Bytes asked for by these calls
+    unsigned long long wastedBytes;              // Bytes handed out beyond the requests
+}SM_SizeClassWaste_t;
+
+/* Snapshot of the counters of one pool. The counters are kept per thread and summed by
+ * SM_getPoolStats, so they are cheap to keep and consistent only to within the calls in flight. */
+typedef struct SM_PoolStats_tag
+{
+    size_t classSize;                            // Block size of the pool
+    unsigned long long allocations;              // Blocks returned by SM_alloc and SM_alloc_batch
+    unsigned long long frees;                    // Blocks given to SM_dealloc and SM_dealloc_batch
+    unsigned long long liveBlocks;               // allocations - frees
+    unsigned long long failedAllocations;        // Allocations which returned nullptr
+    unsigned int usedBlocks;                     // Blocks out of the slabs, including the ones cached by threads
+    unsigned int highWaterBlocks;                // Highest usedBlocks so far
+    unsigned int totalBlocks;                    // Blocks of all slabs
+    unsigned int slabCount;                      // Slabs of the pool
+    size_t totalSize;                            // Bytes of all slabs
+    unsigned long long latencySamples;           // Sum of latency[]
+    unsigned long long latency[SM_LATENCY_BUCKETS];  // Sampled SM_alloc latencies. Empty unless
+                                                 // SM_setLatencySampling is enabled.
+}SM_PoolStats_t;
+
+/* Blocks to provision in one pool. SM_getPoolProfile recommends a profile from the peak usage of a
+ * representative run, and initStorageManagerWithProfile creates every pool of the profile with a
+ * first slab of its own size instead of one size for all pools. */
+typedef struct SM_PoolProfile_tag
+{
+    unsigned int poolSize;                       // Class size of the pool
+    unsigned int initialBlocks;                  // Blocks of its first slab
+}SM_PoolProfile_t;
+
+#define SM_OBJECT_CACHE_NAME_SIZE       32
+
+/* A named cache of constructed objects in the style of Bonwick's slab allocator. Objects are
+ * constructed when their slab is populated and destroyed when the slab is released or purged, so
+ * SM_cache_alloc hands out, and SM_cache_free takes back, objects in their constructed state. */
+typedef struct SM_ObjectCache_tag
+{
+    char name[SM_OBJECT_CACHE_NAME_SIZE];        // Name the cache is found by
+    PoolData_t *pool;                            // Private pool of the cache. Not in the pool map.
+    struct SM_ObjectCache_tag *next;             // Next cache in m_ObjectCacheList
+}SM_ObjectCache_t;
+
+/* A region serves request-scoped allocations. Its blocks are carved in sequence from the slabs of
+ * private pools, one per size class used, and are all released at once by SM_region_reset, which
+ * rewinds nextFreeBlockInSequence and the free list of each slab instead of freeing block by block.
+ * SM_dealloc of a region block does nothing. Between SM_region_begin and SM_region_end, SM_alloc of
+ * the calling thread is served by the region:
+ *
+ *   SM_Region_t *region = SM_region_create();
+ *   SM_region_begin(region);
+ *   while (... next request ...)
+ *   {
+ *       ... handle it with SM_alloc ...
+ *       SM_region_reset(region);
+ *   }
+ *   SM_region_end(region);
+ *   SM_region_destroy(region);
+ *
+ * SM_alloc_class, SM_alloc_batch and object caches are not routed to the region. A region is used
+ * by one thread at a time; its blocks can be read by any thread until the next reset. */
+typedef struct SM_Region_tag
+{
+    PoolData_t *pools[SM_SIZE_CLASS_COUNT];      // Private pool of each small size class, created on first use.
+                                                 // Not in the pool map.
+    vector<PoolData_t*> largePools;              // Private pools of the classes above SM_MAX_SMALL_SIZE
+    struct SM_Region_tag *previous;              // Region the thread used before SM_region_begin
+    struct SM_Region_tag *next;                  // Next region in m_RegionList
+}SM_Region_t;
+
+#define SM_HUGE_PAGE_SIZE               ((size_t)2 << 20)
+
+typedef enum
+{
+    SM_BACKING_MALLOC,                           // Slabs come from posix_memalign
+    SM_BACKING_MMAP                              // Slabs are mapped with mmap and idle slabs give their pages back
+}SM_Backing_t;
+
+typedef enum
+{
+    SM_POLICY_LIFO,                              // The most recently freed block of a slab is handed out first
+    SM_POLICY_LOWEST_ADDRESS                     // The lowest free block of the lowest slab is handed out first, found in
+                                                 // an occupancy bitmap per slab. Live blocks stay packed at the front of
+                                                 // the pool and the slabs at its end drain so they can be released.
+}SM_AllocationPolicy_t;
+
+/* Growth, shrink and backing policy of the pools. Set with SM_configure before initStorageManager.
+ *
+ * colorCount pays off when many pools each keep a few hot blocks. Dependent loads through the first
+ * blocks of every pool, in ns per access, measured with the chase workload of sm_bench (main.cpp):
+ *
+ *   pools                          hot blocks per pool   colors=1   colors=64
+ *   32 object caches of 64 bytes                     1        9.5         5.2
+ *   32 object caches of 64 bytes                     4        9.1         4.7
+ *   32 object caches of 64 bytes                    16        9.8         8.5
+ *   37 size classes of 64 to 16384 bytes             1       10.1         6.6
+ *   37 size classes of 64 to 16384 bytes             4        5.9         6.0
+ */
+typedef struct SM_Config_tag
+{
+    unsigned int growthFactor;                   // Each new slab holds growthFactor times the blocks of the previous one
+    unsigned int maxSlabBlocks;                  // Upper limit on the blocks of a single slab
+    size_t maxPoolSize;                          // Upper limit on the bytes of all slabs of a pool. 0 means no limit.
+    unsigned int shrinkWatermark;                // An empty slab is returned to the OS when less than shrinkWatermark
+                                                 // percent of the pool's blocks are used. A pool always keeps one slab.
+    SM_Backing_t backing;                        // Where slab memory comes from
+    bool useHugePages;                           // SM_BACKING_MMAP: map slabs of SM_HUGE_PAGE_SIZE and more on huge page
+                                                 // boundaries and ask for transparent huge pages
+    unsigned int decayTime;                      // SM_BACKING_MMAP: milliseconds an empty slab stays resident before its
+                                                 // pages are given back to the OS. Checked when slabs empty and on the
+                                                 // allocation slow path; a process which stops allocating must call
+                                                 // SM_purge periodically.
+    bool useMadvFree;                            // SM_BACKING_MMAP: give pages back with MADV_FREE, which the kernel
+                                                 // reclaims lazily, instead of MADV_DONTNEED
+    unsigned int colorCount;                     // Successive slabs start at up to colorCount different offsets, a cache
+                                                 // line or the pool alignment apart, so blocks of different slabs and
+                                                 // pools do not compete for the same cache sets. 1 disables coloring.
+    SM_AllocationPolicy_t allocationPolicy;      // Which free block of a pool is handed out next. Regions always carve
+                                                 // in sequence. The per-thread magazines stay LIFO.
+}SM_Config_t;
+
+/* SM_configure and initStorageManager must be called before other threads use the storage manager.
+ * SM_alloc and SM_dealloc can then be called from any thread. destroyStorageManager must be called
+ * after the other threads stopped using it. */
+void SM_configure(const SM_Config_t *config);
+void SM_getConfig(SM_Config_t *config);
 void initStorageManager(const unsigned int poolSize, int numPools, const unsigned int *pools);
-void initializePoolData(size_t sizeToAllocate, char *ptr, unsigned int size, PoolData_t *poolData);
+void initStorageManagerWithProfile(const unsigned int poolSize, int numPools, const SM_PoolProfile_t *profile);
+void initializePoolData(unsigned int size, PoolData_t *poolData);
 void displayPoolInfo();
 void destroyStorageManager();
 void *SM_alloc(size_t size);
 void SM_dealloc(void *ptr);
+unsigned int SM_alloc_batch(size_t size, unsigned int count, void **out);
+void SM_dealloc_batch(void **ptrs, unsigned int count);
+void *SM_alloc_class(unsigned int sizeClass, size_t size);
+void SM_dealloc_class(void *ptr, unsigned int sizeClass);
 unsigned int findPoolFromAddress(void *ptr);
-char *findAddressFromBlock(unsigned int block, PoolData_t *poolData);
-unsigned int findBlockFromAddress(char *addr, PoolData_t *poolData);
-void createNewPool(unsigned size);
-void expandPool(unsigned size);
+Slab_t *findSlabFromAddress(void *ptr);
+Slab_t *findSlabOfBlock(void *ptr);
+char *findAddressFromBlock(unsigned int block, Slab_t *slab);
+unsigned int findBlockFromAddress(char *addr, Slab_t *slab);
+PoolData_t *findPoolFromSize(size_t size);
+PoolData_t *createNewPool(unsigned size);
+Slab_t *expandPool(PoolData_t *poolData);
+void shrinkPool(PoolData_t *poolData);
+void SM_purge(bool force);
+void flushThreadCache();
+int SM_getSizeClassWaste(SM_SizeClassWaste_t *waste, int maxClasses);
+void displaySizeClassWaste();
+int SM_getPoolStats(SM_PoolStats_t *stats, int maxPools);
+void SM_setLatencySampling(unsigned int interval);
+int SM_getPoolProfile(SM_PoolProfile_t *profile, int maxPools, unsigned int headroom);
+void displayPoolProfile(unsigned int headroom);
+void SM_autoTune(unsigned int headroom);
+bool SM_setPoolAlignment(size_t size, unsigned int alignment);
+SM_ObjectCache_t *SM_cache_create(const char *name, size_t objectSize, size_t alignment,
+                                  SM_ObjectFunction_t constructor, SM_ObjectFunction_t destructor);
+SM_ObjectCache_t *SM_cache_find(const char *name);
+void *SM_cache_alloc(SM_ObjectCache_t *cache);
+void SM_cache_free(SM_ObjectCache_t *cache, void *object);
+void SM_cache_destroy(SM_ObjectCache_t *cache);
+SM_Region_t *SM_region_create();
+void SM_region_begin(SM_Region_t *region);
+void SM_region_end(SM_Region_t *region);
+void *SM_region_alloc(SM_Region_t *region, size_t size);
+void SM_region_reset(SM_Region_t *region);
+void SM_region_destroy(SM_Region_t *region);
+bool SM_saveSnapshot(const char *path, void *root);
+bool SM_loadSnapshot(const char *path, void **root);
 #endif
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef SM_ALLOCATOR_H
+#define SM_ALLOCATOR_H
+#include <stddef.h>
+#include <new>
+#include <memory_resource>
+
+#include "sm.h"
+
+/* C++ layer on top of the storage manager so that standard containers can keep their elements and
+ * nodes in the pools.
+ *
+ *   vector<Packet, SM_Allocator<Packet> > packets;
+ *   pmr::unordered_map<int, Session> sessions(SM_getMemoryResource());
+ *
+ * Blocks of a size class of n bytes are aligned to the largest power of two dividing n, and a size
+ * which is a multiple of an alignment up to SM_REGION_SIZE always rounds up to a class which is a
+ * multiple of that alignment. Both adapters rely on this instead of keeping per-block headers. */
+
+/* Standard allocator of T. A single element, which is what node based containers ask for, goes to
+ * the magazine of the size class of T. The class is computed at compile time, so neither the size
+ * lookup of SM_alloc nor the slab directory lookup of SM_dealloc is done. Arrays are served by
+ * SM_alloc. Throws bad_alloc when the pool cannot grow. */
+template<class T>
+class SM_Allocator
+{
+public:
+    typedef T value_type;
+
+    SM_Allocator() noexcept
+    {
+    }
+
+    template<class U>
+    SM_Allocator(const SM_Allocator<U> &) noexcept
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        void *ptr = nullptr;
+        if (n == 1 && isSmallClass)
+        {
+            ptr = SM_alloc_class(sizeClass, sizeof(T));
+        }
+        else if (n <= (size_t)-1 / sizeof(T))
+        {
+            ptr = SM_alloc(n * sizeof(T));
+        }
+
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return (T *)ptr;
+    }
+
+    void deallocate(T *ptr, size_t n) noexcept
+    {
+        if (n == 1 && isSmallClass)
+        {
+            SM_dealloc_class(ptr, sizeClass);
+        }
+        else
+        {
+            SM_dealloc(ptr);
+        }
+    }
+
+private:
+    static_assert(alignof(T) <= SM_REGION_SIZE, "SM_Allocator cannot align blocks beyond SM_REGION_SIZE");
+
+    static constexpr bool isSmallClass = sizeof(T) <= SM_MAX_SMALL_SIZE;
+    static constexpr unsigned int sizeClass = isSmallClass ? SM_sizeClassIndex(sizeof(T)) : 0;
+};
+
+/* All SM_Allocators share the same pools, so any of them can free what another allocated */
+template<class T, class U>
+bool operator==(const SM_Allocator<T> &, const SM_Allocator<U> &) noexcept
+{
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const SM_Allocator<T> &, const SM_Allocator<U> &) noexcept
+{
+    return false;
+}
+
+/* Polymorphic memory resource serving std::pmr containers from the pools. The size is only known at
+ * run time, so requests go through SM_alloc and SM_dealloc. Alignments above SM_REGION_SIZE are
+ * passed to the upstream resource. */
+class SM_MemoryResource : public std::pmr::memory_resource
+{
+public:
+    explicit SM_MemoryResource(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource()) noexcept
+        : m_Upstream(upstream)
+    {
+    }
+
+private:
+    /* Rounds bytes up to a multiple of alignment, which puts it in a class aligned to alignment */
+    static size_t alignedSize(size_t bytes, size_t alignment)
+    {
+        return (bytes + alignment - 1) & ~(alignment - 1);
+    }
+
+    void *do_allocate(size_t bytes, size_t alignment) override
+    {
+        if (alignment > SM_REGION_SIZE)
+        {
+            return m_Upstream->allocate(bytes, alignment);
+        }
+
+        void *ptr = SM_alloc(bytes > 0 ? alignedSize(bytes, alignment) : 1);
+        if (ptr == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, size_t bytes, size_t alignment) override
+    {
+        if (alignment > SM_REGION_SIZE)
+        {
+            m_Upstream->deallocate(ptr, bytes, alignment);
+            return;
+        }
+        SM_dealloc(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        const SM_MemoryResource *resource = dynamic_cast<const SM_MemoryResource *>(&other);
+        return resource != nullptr && resource->m_Upstream->is_equal(*m_Upstream);
+    }
+
+    std::pmr::memory_resource *m_Upstream;   // Serves alignments the pools cannot
+};
+
+/* Process wide SM_MemoryResource */
+inline std::pmr::memory_resource *SM_getMemoryResource() noexcept
+{
+    static SM_MemoryResource resource;
+    return &resource;
+}
+#endif
@@ -0,0 +1,383 @@
+#include "sm_shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Free list heads pack a generation in the high half and the block number (offset divided by
+ * SM_SIZE_CLASS_QUANTUM) in the low half. The generation changes with every update, so a process
+ * which read a head cannot swap it after the block was popped and pushed again by another one. */
+#define SHARED_BLOCK_BITS               32
+#define SHARED_BLOCK_MASK               (((uint64_t)1 << SHARED_BLOCK_BITS) - 1)
+
+static_assert(atomic<uint64_t>::is_always_lock_free, "Shared pools need lock-free 64 bit atomics");
+static_assert(SM_SIZE_CLASS_COUNT <= 255, "Region classes are stored in a byte");
+static_assert(SM_MAX_SMALL_SIZE <= SM_REGION_SIZE, "A region must hold a block of every small size class");
+
+typedef struct SharedClass_tag
+{
+    alignas(SM_CACHE_LINE_SIZE)
+    atomic<uint64_t> freeList;                   // Generation and block number of the first free block. 0 if empty.
+    atomic<uint32_t> regionCount;                // Regions claimed by this class
+    uint32_t blockSize;                          // Size of each block of this class
+}SharedClass_t;
+
+/* Start of a shared pool. The region classes follow it and the regions start at regionsOffset. */
+typedef struct SharedHeader_tag
+{
+    char magic[8];                               // SM_SHARED_MAGIC, written last by SM_shared_create
+    uint64_t poolSize;                           // Bytes of the pool
+    uint64_t regionsOffset;                      // Offset of the first region, a multiple of SM_REGION_SIZE
+    uint32_t regionCount;                        // Regions of the pool
+    uint32_t regionSize;                         // SM_REGION_SIZE of the creating process
+    uint32_t classCount;                         // SM_SIZE_CLASS_COUNT of the creating process
+    atomic<uint32_t> nextRegion;                 // Regions claimed so far
+    atomic<uint32_t> attachCount;                // Processes which currently map the pool
+    atomic<uint64_t> root;                       // Offset published with SM_shared_setRoot
+    SharedClass_t classes[SM_SIZE_CLASS_COUNT];
+}SharedHeader_t;
+
+static inline SharedHeader_t *sharedHeader(SM_SharedPool_t *pool)
+{
+    return (SharedHeader_t *)pool->base;
+}
+
+/* Class of every region, SM_SIZE_CLASS_COUNT while the region is unclaimed */
+static inline uint8_t *regionClasses(SM_SharedPool_t *pool)
+{
+    return (uint8_t *)(sharedHeader(pool) + 1);
+}
+
+/* Link to the next free block, kept in the first bytes of a free block like FreeBlock_t. A block can
+ * be read here by a process whose pop is about to fail while its new owner writes it. */
+static inline uint64_t loadLink(SM_SharedPool_t *pool, uint64_t offset)
+{
+    return __atomic_load_n((uint64_t *)(pool->base + offset), __ATOMIC_RELAXED);
+}
+
+static inline void storeLink(SM_SharedPool_t *pool, uint64_t offset, uint64_t next)
+{
+    __atomic_store_n((uint64_t *)(pool->base + offset), next, __ATOMIC_RELAXED);
+}
+
+static uint64_t popSharedBlock(SM_SharedPool_t *pool, SharedClass_t *sharedClass)
+{
+    uint64_t head = sharedClass->freeList.load(memory_order_acquire);
+    while ((head & SHARED_BLOCK_MASK) != 0)
+    {
+        uint64_t offset = (head & SHARED_BLOCK_MASK) * SM_SIZE_CLASS_QUANTUM;
+        uint64_t next = loadLink(pool, offset) / SM_SIZE_CLASS_QUANTUM;
+        uint64_t newHead = (((head >> SHARED_BLOCK_BITS) + 1) << SHARED_BLOCK_BITS) | next;
+        if (sharedClass->freeList.compare_exchange_weak(head, newHead, memory_order_acquire, memory_order_acquire))
+        {
+            return offset;
+        }
+    }
+    return 0;
+}
+
+/* Pushes the chain of free blocks from first to last, already linked to each other */
+static void pushSharedBlocks(SM_SharedPool_t *pool, SharedClass_t *sharedClass, uint64_t first, uint64_t last)
+{
+    uint64_t head = sharedClass->freeList.load(memory_order_relaxed);
+    uint64_t newHead;
+    do
+    {
+        storeLink(pool, last, (head & SHARED_BLOCK_MASK) * SM_SIZE_CLASS_QUANTUM);
+        newHead = (((head >> SHARED_BLOCK_BITS) + 1) << SHARED_BLOCK_BITS) | (first / SM_SIZE_CLASS_QUANTUM);
+    } while (!sharedClass->freeList.compare_exchange_weak(head, newHead, memory_order_release, memory_order_relaxed));
+}
+
+/* Claims a region for a class, keeps its first block and pushes the others. Processes which find the
+ * same class empty at the same time each claim a region. Returns 0 when the pool is full. */
+static uint64_t claimSharedRegion(SM_SharedPool_t *pool, unsigned int sizeClass)
+{
+    SharedHeader_t *header = sharedHeader(pool);
+    SharedClass_t *sharedClass = &header->classes[sizeClass];
+
+    uint32_t region = header->nextRegion.load(memory_order_relaxed);
+    do
+    {
+        if (region >= header->regionCount)
+        {
+            return 0;
+        }
+    } while (!header->nextRegion.compare_exchange_weak(region, region + 1, memory_order_relaxed));
+
+    regionClasses(pool)[region] = (uint8_t)sizeClass;
+    sharedClass->regionCount.fetch_add(1, memory_order_relaxed);
+
+    uint64_t first = header->regionsOffset + ((uint64_t)region << SM_REGION_SHIFT);
+    uint32_t blocks = (uint32_t)(SM_REGION_SIZE / sharedClass->blockSize);
+    if (blocks > 1)
+    {
+        uint64_t second = first + sharedClass->blockSize;
+        uint64_t last = first + (uint64_t)(blocks - 1) * sharedClass->blockSize;
+        for (uint64_t offset = second; offset < last; offset += sharedClass->blockSize)
+        {
+            storeLink(pool, offset, offset + sharedClass->blockSize);
+        }
+        pushSharedBlocks(pool, sharedClass, second, last);
+    }
+    return first;
+}
+
+/* Maps size bytes of fd shared and wraps them in a SM_SharedPool_t, or returns nullptr */
+static SM_SharedPool_t *mapSharedPool(int fd, size_t size)
+{
+    void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    SM_SharedPool_t *pool = (SM_SharedPool_t *)malloc(sizeof(SM_SharedPool_t));
+    if (pool == nullptr)
+    {
+        munmap(base, size);
+        return nullptr;
+    }
+    pool->base = (char *)base;
+    pool->size = size;
+    pool->fd = fd;
+    return pool;
+}
+
+/**
+ * The function `SM_shared_create` creates a shared pool of `size` bytes and maps it.
+ *
+ * @param name Name of the POSIX shared memory object, such as "/ingest", which other processes pass to
+ * SM_shared_attach. nullptr creates an anonymous memfd instead, which is inherited by forked children
+ * or passed to other processes over a Unix socket and mapped with SM_shared_attach_fd.
+ * @param size Bytes of the pool, rounded up to SM_REGION_SIZE. At most SM_SHARED_MAX_SIZE. Pages are
+ * only backed by memory once blocks are carved from them.
+ *
+ * @return The mapping of the new pool, or nullptr if the name exists or the pool cannot be created.
+ */
+SM_SharedPool_t *SM_shared_create(const char *name, size_t size)
+{
+    size = (size + SM_REGION_SIZE - 1) & ~(SM_REGION_SIZE - 1);
+    size_t regionsOffset = (sizeof(SharedHeader_t) + size / SM_REGION_SIZE + SM_REGION_SIZE - 1) & ~(SM_REGION_SIZE - 1);
+    if (size <= regionsOffset || size > SM_SHARED_MAX_SIZE)
+    {
+        printf("ERROR: SM_shared_create: Invalid shared pool size %zu!\n", size);
+        return nullptr;
+    }
+
+    int fd = name != nullptr ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : memfd_create("sm_shared", MFD_CLOEXEC);
+    if (fd < 0)
+    {
+        printf("ERROR: SM_shared_create: Cannot create shared pool %s!\n", name != nullptr ? name : "(memfd)");
+        return nullptr;
+    }
+
+    SM_SharedPool_t *pool = nullptr;
+    if (ftruncate(fd, (off_t)size) == 0)
+    {
+        pool = mapSharedPool(fd, size);
+    }
+    if (pool == nullptr)
+    {
+        printf("\n\n**MEMORY ERROR: SM_shared_create: Failed to map %zu bytes!!\n\n", size);
+        close(fd);
+        if (name != nullptr)
+        {
+            shm_unlink(name);
+        }
+        return nullptr;
+    }
+
+    /* A new shm object or memfd reads as zeroes, so only the non zero fields are set */
+    SharedHeader_t *header = sharedHeader(pool);
+    header->poolSize = size;
+    header->regionsOffset = regionsOffset;
+    header->regionCount = (uint32_t)((size - regionsOffset) / SM_REGION_SIZE);
+    header->regionSize = SM_REGION_SIZE;
+    header->classCount = SM_SIZE_CLASS_COUNT;
+    header->attachCount.store(1, memory_order_relaxed);
+    for (size_t classSize = SM_SIZE_CLASS_QUANTUM; classSize <= SM_MAX_SMALL_SIZE; classSize = SM_sizeClassSize(classSize + 1))
+    {
+        header->classes[SM_sizeClassIndex(classSize)].blockSize = (uint32_t)classSize;
+    }
+    memset(regionClasses(pool), SM_SIZE_CLASS_COUNT, header->regionCount);
+
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, SM_SHARED_MAGIC, sizeof(header->magic));
+    return pool;
+}
+
+/**
+ * The function `SM_shared_attach_fd` maps the shared pool behind `fd`, a memfd from SM_shared_create
+ * received by this process. The pool keeps its own duplicate of the descriptor.
+ *
+ * @return The mapping of the pool, or nullptr if `fd` is not an initialized shared pool built with
+ * the same size classes.
+ */
+SM_SharedPool_t *SM_shared_attach_fd(int fd)
+{
+    struct stat status;
+    int poolFd = dup(fd);
+    if (poolFd < 0 || fstat(poolFd, &status) != 0 || (size_t)status.st_size < sizeof(SharedHeader_t))
+    {
+        printf("ERROR: SM_shared_attach: Not a shared pool!\n");
+        if (poolFd >= 0)
+        {
+            close(poolFd);
+        }
+        return nullptr;
+    }
+
+    SM_SharedPool_t *pool = mapSharedPool(poolFd, (size_t)status.st_size);
+    if (pool == nullptr)
+    {
+        printf("\n\n**MEMORY ERROR: SM_shared_attach: Failed to map %zu bytes!!\n\n", (size_t)status.st_size);
+        close(poolFd);
+        return nullptr;
+    }
+
+    SharedHeader_t *header = sharedHeader(pool);
+    bool isValid = memcmp(header->magic, SM_SHARED_MAGIC, sizeof(header->magic)) == 0;
+    atomic_thread_fence(memory_order_acquire);
+    if (!isValid || header->poolSize != pool->size || header->regionSize != SM_REGION_SIZE ||
+        header->classCount != SM_SIZE_CLASS_COUNT ||
+        header->classes[SM_SIZE_CLASS_COUNT - 1].blockSize != SM_sizeClassSize(SM_MAX_SMALL_SIZE))
+    {
+        printf("ERROR: SM_shared_attach: Not a shared pool of this storage manager!\n");
+        munmap(pool->base, pool->size);
+        close(poolFd);
+        free(pool);
+        return nullptr;
+    }
+
+    header->attachCount.fetch_add(1, memory_order_relaxed);
+    return pool;
+}
+
+/**
+ * The function `SM_shared_attach` maps the shared pool created with SM_shared_create under `name`.
+ *
+ * @return The mapping of the pool, or nullptr if there is no such pool.
+ */
+SM_SharedPool_t *SM_shared_attach(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        printf("ERROR: SM_shared_attach: No shared pool %s!\n", name);
+        return nullptr;
+    }
+    SM_SharedPool_t *pool = SM_shared_attach_fd(fd);
+    close(fd);
+    return pool;
+}
+
+/**
+ * The function `SM_shared_detach` unmaps a shared pool from this process. The pool and its blocks
+ * stay available to the other processes, and a named pool until SM_shared_unlink.
+ */
+void SM_shared_detach(SM_SharedPool_t *pool)
+{
+    if (pool == nullptr)
+    {
+        return;
+    }
+    sharedHeader(pool)->attachCount.fetch_sub(1, memory_order_relaxed);
+    munmap(pool->base, pool->size);
+    close(pool->fd);
+    free(pool);
+}
+
+/**
+ * The function `SM_shared_unlink` removes the name of a shared pool. Processes which mapped it keep
+ * using it, and its memory is freed when the last one detaches.
+ */
+bool SM_shared_unlink(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+/**
+ * The function `SM_shared_alloc` allocates a block from a shared pool. Sizes are rounded up to the
+ * same size classes as SM_alloc.
+ *
+ * @param size Requested size in bytes, at most SM_MAX_SMALL_SIZE.
+ *
+ * @return The block, or nullptr if the size is too large or the pool is full.
+ */
+void *SM_shared_alloc(SM_SharedPool_t *pool, size_t size)
+{
+    if (size > SM_MAX_SMALL_SIZE)
+    {
+        printf("ERROR: SM_shared_alloc: %zu bytes is larger than the largest shared pool class!\n", size);
+        return nullptr;
+    }
+
+    unsigned int sizeClass = SM_sizeClassIndex(size);
+    uint64_t offset = popSharedBlock(pool, &sharedHeader(pool)->classes[sizeClass]);
+    if (offset == 0)
+    {
+        offset = claimSharedRegion(pool, sizeClass);
+    }
+    return SM_shared_pointer(pool, offset);
+}
+
+/**
+ * The function `SM_shared_free` gives a block back to its shared pool. Any process mapping the pool
+ * can free a block allocated by any other one.
+ */
+void SM_shared_free(SM_SharedPool_t *pool, void *ptr)
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+
+    SharedHeader_t *header = sharedHeader(pool);
+    uint64_t offset = SM_shared_offset(pool, ptr);
+    uint64_t region = (offset - header->regionsOffset) >> SM_REGION_SHIFT;
+    unsigned int sizeClass = offset >= header->regionsOffset && region < header->regionCount ?
+                             regionClasses(pool)[region] : SM_SIZE_CLASS_COUNT;
+    if (sizeClass >= SM_SIZE_CLASS_COUNT ||
+        ((offset - header->regionsOffset) & (SM_REGION_SIZE - 1)) % header->classes[sizeClass].blockSize != 0)
+    {
+        /* If we reached here, it means something is wrong! */
+        printf("\n\n**ERROR: %p not present in the shared pool!!\n\n", ptr);
+        abort();
+    }
+
+    pushSharedBlocks(pool, &header->classes[sizeClass], offset, offset);
+}
+
+/**
+ * The function `SM_shared_setRoot` publishes the offset of a block, typically the head of a shared
+ * data structure, so that processes attaching later can find it with SM_shared_getRoot.
+ */
+void SM_shared_setRoot(SM_SharedPool_t *pool, uint64_t offset)
+{
+    sharedHeader(pool)->root.store(offset, memory_order_release);
+}
+
+uint64_t SM_shared_getRoot(SM_SharedPool_t *pool)
+{
+    return sharedHeader(pool)->root.load(memory_order_acquire);
+}
+
+void displaySharedPool(SM_SharedPool_t *pool)
+{
+    SharedHeader_t *header = sharedHeader(pool);
+    printf("Shared pool at %p: %zu bytes, %u of %u regions used, %u processes attached\n", pool->base, pool->size,
+           header->nextRegion.load(memory_order_relaxed), header->regionCount,
+           header->attachCount.load(memory_order_relaxed));
+    for (unsigned int i = 0; i < SM_SIZE_CLASS_COUNT; i++)
+    {
+        unsigned int regions = header->classes[i].regionCount.load(memory_order_relaxed);
+        if (regions > 0)
+        {
+            printf("  Class %u: %u regions of %zu blocks\n", header->classes[i].blockSize, regions,
+                   SM_REGION_SIZE / header->classes[i].blockSize);
+        }
+    }
+}
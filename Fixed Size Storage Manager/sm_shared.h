@@ -0,0 +1,62 @@
+#ifndef SM_SHARED_H
+#define SM_SHARED_H
+#include <stdint.h>
+#include <stddef.h>
+
+#include "sm.h"
+
+/* Shared pools. A shared pool is one shm_open or memfd mapping holding the blocks of the small size
+ * classes together with all of their bookkeeping, so any number of processes can map it and allocate
+ * and free blocks in it concurrently. A block allocated by one process can be handed to another one
+ * without copying:
+ *
+ *   ingest:     Packet *packet = (Packet *)SM_shared_alloc(pool, sizeof(Packet));
+ *               ... fill packet ...
+ *               uint64_t offset = SM_shared_offset(pool, packet);   // send the 8 bytes to the worker
+ *
+ *   processing: Packet *packet = (Packet *)SM_shared_pointer(pool, offset);
+ *               ... use packet ...
+ *               SM_shared_free(pool, packet);
+ *
+ * Every process maps the pool at its own address, so everything stored in the pool refers to other
+ * blocks by offset, never by pointer. The free lists are offset based lock-free stacks, one per size
+ * class, and new regions are claimed with an atomic counter. No lock is ever held, so a process dying
+ * in the middle of a call can at most leak the blocks it was moving. Shared pools are independent of
+ * initStorageManager and the process local pools; their blocks must only be freed with
+ * SM_shared_free. */
+
+#define SM_SHARED_MAGIC                 "SMSHARE1"
+#define SM_SHARED_MAX_SIZE              ((size_t)SM_SIZE_CLASS_QUANTUM << 32)    // Free list links are 32 bit
+                                                                                  // block numbers
+
+/* Mapping of a shared pool in this process */
+typedef struct SM_SharedPool_tag
+{
+    char *base;                                  // Address the pool is mapped at in this process
+    size_t size;                                 // Bytes mapped
+    int fd;                                      // Descriptor of the shm_open object or memfd
+}SM_SharedPool_t;
+
+SM_SharedPool_t *SM_shared_create(const char *name, size_t size);
+SM_SharedPool_t *SM_shared_attach(const char *name);
+SM_SharedPool_t *SM_shared_attach_fd(int fd);
+void SM_shared_detach(SM_SharedPool_t *pool);
+bool SM_shared_unlink(const char *name);
+void *SM_shared_alloc(SM_SharedPool_t *pool, size_t size);
+void SM_shared_free(SM_SharedPool_t *pool, void *ptr);
+void SM_shared_setRoot(SM_SharedPool_t *pool, uint64_t offset);
+uint64_t SM_shared_getRoot(SM_SharedPool_t *pool);
+void displaySharedPool(SM_SharedPool_t *pool);
+
+/* Offset of a block of the pool, the same in every process mapping it. 0 is never a block. */
+inline uint64_t SM_shared_offset(const SM_SharedPool_t *pool, const void *ptr)
+{
+    return ptr != nullptr ? (uint64_t)((const char *)ptr - pool->base) : 0;
+}
+
+/* Address in this process of the block at offset. nullptr for offset 0. */
+inline void *SM_shared_pointer(const SM_SharedPool_t *pool, uint64_t offset)
+{
+    return offset != 0 ? pool->base + offset : nullptr;
+}
+#endif
@@ -0,0 +1,213 @@
+#include "sm_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+/* Raw event as logged by a thread. Addresses are turned into object ids when the trace is written. */
+typedef struct TraceEvent_tag
+{
+    unsigned long long timestamp;                // CLOCK_MONOTONIC nanoseconds
+    uintptr_t address;                           // Block allocated or freed
+    unsigned int size;                           // Requested bytes of an allocation
+    unsigned short thread;                       // Index of the logging thread
+    unsigned char op;                            // SM_TraceOp_t
+}TraceEvent_t;
+
+typedef struct TraceChunk_tag
+{
+    unsigned int count;                          // Events used. Only the owning thread writes them.
+    TraceEvent_t events[SM_TRACE_CHUNK_EVENTS];
+}TraceChunk_t;
+
+atomic<bool> m_IsTracing;
+vector<TraceChunk_t*> m_TraceChunks;                                  // Chunks of all threads in this session
+atomic<unsigned int> m_TraceSession;                                  // Incremented by SM_traceStart and SM_traceStop.
+                                                                      // Written under m_TraceLock, read without it.
+unsigned short m_TraceThreadCount;                                    // Threads which logged in this session
+pthread_mutex_t m_TraceLock = PTHREAD_MUTEX_INITIALIZER;              // Protects the globals above
+thread_local TraceChunk_t *t_TraceChunk;                              // Chunk the calling thread logs to
+thread_local unsigned int t_TraceSession;                             // Session t_TraceChunk belongs to
+thread_local unsigned short t_TraceThread;                            // Index of the calling thread
+
+/* Starts a new chunk for the calling thread. Allocated with malloc so tracing never calls SM_alloc. */
+static TraceChunk_t *newTraceChunk()
+{
+    TraceChunk_t *chunk = (TraceChunk_t *)malloc(sizeof(TraceChunk_t));
+    if (chunk == nullptr)
+    {
+        return nullptr;
+    }
+    chunk->count = 0;
+
+    pthread_mutex_lock(&m_TraceLock);
+    unsigned int session = m_TraceSession.load(memory_order_relaxed);
+    if (t_TraceSession != session || t_TraceChunk == nullptr)
+    {
+        t_TraceThread = m_TraceThreadCount++;
+        t_TraceSession = session;
+    }
+    m_TraceChunks.push_back(chunk);
+    pthread_mutex_unlock(&m_TraceLock);
+
+    t_TraceChunk = chunk;
+    return chunk;
+}
+
+static void logTraceEvent(unsigned char op, void *ptr, size_t size)
+{
+    TraceChunk_t *chunk = t_TraceChunk;
+    unsigned int session = m_TraceSession.load(memory_order_acquire);
+    if (chunk == nullptr || t_TraceSession != session || chunk->count == SM_TRACE_CHUNK_EVENTS)
+    {
+        if (t_TraceSession != session)
+        {
+            t_TraceChunk = nullptr;
+        }
+        chunk = newTraceChunk();
+        if (chunk == nullptr)
+        {
+            return;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    TraceEvent_t *event = &chunk->events[chunk->count++];
+    event->timestamp = (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+    event->address = (uintptr_t)ptr;
+    event->size = size > UINT32_MAX ? UINT32_MAX : (unsigned int)size;
+    event->thread = t_TraceThread;
+    event->op = op;
+}
+
+/**
+ * The function `SM_traceStart` starts logging allocations. Events are kept in memory, 24 bytes each,
+ * until SM_traceStop writes them.
+ *
+ * @return false if a trace is already being recorded.
+ */
+bool SM_traceStart()
+{
+    pthread_mutex_lock(&m_TraceLock);
+    if (m_IsTracing.load(memory_order_relaxed))
+    {
+        pthread_mutex_unlock(&m_TraceLock);
+        printf("ERROR: SM_traceStart: A trace is already being recorded!\n");
+        return false;
+    }
+    m_TraceSession.store(m_TraceSession.load(memory_order_relaxed) + 1, memory_order_release);
+    m_TraceThreadCount = 0;
+    m_IsTracing.store(true, memory_order_release);
+    pthread_mutex_unlock(&m_TraceLock);
+    return true;
+}
+
+/**
+ * The function `SM_traceStop` stops logging and writes the trace to `path`. It must be called after
+ * the traced threads stopped allocating, as their buffers are read and released.
+ *
+ * @return The number of records written, or -1 if the file cannot be written.
+ */
+long long SM_traceStop(const char *path)
+{
+    pthread_mutex_lock(&m_TraceLock);
+    m_IsTracing.store(false, memory_order_relaxed);
+    vector<TraceChunk_t*> chunks;
+    chunks.swap(m_TraceChunks);
+    unsigned short threadCount = m_TraceThreadCount;
+    m_TraceSession.store(m_TraceSession.load(memory_order_relaxed) + 1, memory_order_release);
+    pthread_mutex_unlock(&m_TraceLock);
+
+    vector<TraceEvent_t> events;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        events.insert(events.end(), chunks[i]->events, chunks[i]->events + chunks[i]->count);
+        free(chunks[i]);
+    }
+
+    /* A free is logged before the block is given back and an allocation after the block is taken, so
+     * in time order a reused address is always freed before it is allocated again */
+    stable_sort(events.begin(), events.end(), [](const TraceEvent_t &a, const TraceEvent_t &b)
+    {
+        return a.timestamp < b.timestamp;
+    });
+
+    FILE *file = fopen(path, "wb");
+    if (file == nullptr)
+    {
+        printf("ERROR: SM_traceStop: Cannot write %s!\n", path);
+        return -1;
+    }
+
+    SM_TraceHeader_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SM_TRACE_MAGIC, sizeof(header.magic));
+    header.threadCount = threadCount;
+    fwrite(&header, sizeof(header), 1, file);
+
+    unordered_map<uintptr_t, uint32_t> liveObjects;
+    unsigned long long previousTimestamp = events.empty() ? 0 : events[0].timestamp;
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        SM_TraceRecord_t record;
+        memset(&record, 0, sizeof(record));
+
+        if (events[i].op == SM_TRACE_ALLOC)
+        {
+            record.objectId = header.objectCount++;
+            record.size = events[i].size;
+            liveObjects[events[i].address] = record.objectId;
+        }
+        else
+        {
+            unordered_map<uintptr_t, uint32_t>::iterator it = liveObjects.find(events[i].address);
+            if (it == liveObjects.end())
+            {
+                continue;
+            }
+            record.objectId = it->second;
+            liveObjects.erase(it);
+        }
+
+        unsigned long long delta = events[i].timestamp - previousTimestamp;
+        previousTimestamp = events[i].timestamp;
+        record.timeDelta = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+        record.thread = events[i].thread;
+        record.op = events[i].op;
+        fwrite(&record, sizeof(record), 1, file);
+        header.recordCount++;
+    }
+
+    rewind(file);
+    fwrite(&header, sizeof(header), 1, file);
+    bool isWritten = ferror(file) == 0;
+    isWritten = fclose(file) == 0 && isWritten;
+    if (!isWritten)
+    {
+        printf("ERROR: SM_traceStop: Cannot write %s!\n", path);
+        return -1;
+    }
+    return (long long)header.recordCount;
+}
+
+void SM_traceAlloc(void *ptr, size_t size)
+{
+    if (ptr != nullptr)
+    {
+        logTraceEvent(SM_TRACE_ALLOC, ptr, size);
+    }
+}
+
+void SM_traceFree(void *ptr)
+{
+    if (ptr != nullptr)
+    {
+        logTraceEvent(SM_TRACE_FREE, ptr, 0);
+    }
+}
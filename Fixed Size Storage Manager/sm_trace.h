@@ -0,0 +1,53 @@
+#ifndef SM_TRACE_H
+#define SM_TRACE_H
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+using namespace std;
+
+/* Allocation traces. While tracing, every SM_alloc and SM_dealloc (and their batch and class
+ * variants) is logged to a per-thread buffer. SM_traceStop orders the events of all threads by time,
+ * numbers the objects and writes the trace file:
+ *
+ *   SM_TraceHeader_t
+ *   SM_TraceRecord_t[recordCount]
+ *
+ * Objects get dense ids in allocation order, so a replay needs one table entry per object and no
+ * address lookup. Frees of objects allocated before tracing started are dropped. The replay tool in
+ * "Allocation Trace Replay" runs a trace against every allocator of this repo and malloc. */
+
+#define SM_TRACE_MAGIC                  "SMTRACE1"
+#define SM_TRACE_CHUNK_EVENTS           65536    // Events buffered per chunk of a thread
+
+typedef enum
+{
+    SM_TRACE_ALLOC,
+    SM_TRACE_FREE
+}SM_TraceOp_t;
+
+typedef struct SM_TraceHeader_tag
+{
+    char magic[8];                               // SM_TRACE_MAGIC
+    uint64_t recordCount;                        // Records following the header
+    uint32_t objectCount;                        // Objects allocated in the trace. Ids are below this.
+    uint32_t threadCount;                        // Threads which recorded events
+}SM_TraceHeader_t;
+
+typedef struct SM_TraceRecord_tag
+{
+    uint32_t objectId;                           // Object allocated or freed
+    uint32_t size;                               // Requested bytes of an allocation. 0 for a free.
+    uint32_t timeDelta;                          // Nanoseconds since the previous record, saturated
+    uint16_t thread;                             // Index of the recording thread
+    uint8_t op;                                  // SM_TraceOp_t
+    uint8_t reserved;
+}SM_TraceRecord_t;
+
+extern atomic<bool> m_IsTracing;                 // Checked by SM_alloc and SM_dealloc before logging
+
+bool SM_traceStart();
+long long SM_traceStop(const char *path);
+void SM_traceAlloc(void *ptr, size_t size);
+void SM_traceFree(void *ptr);
+#endif
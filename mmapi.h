@@ -15,20 +15,34 @@ typedef struct PageTableEntry {
     int permissions;          // Access permissions for the page
 } PageTableEntry;
 
+/* Handle of a registered page family. Allocating through it skips the lookup of the family by name. */
+typedef struct vm_page_family_ *mm_page_family_handle_t;
+
 /* Function declarations */
 
-// Allocate memory and initialize to zero
+// Allocate memory and initialize to zero. Thread safe: every thread allocates from pages of its own heap.
 void *xcalloc(char *struct_name, int units);
 
-// Free dynamically allocated memory
+// Allocate memory of the page family returned by mm_instantiate_new_page_family and initialize it to zero
+void *xcalloc_h(mm_page_family_handle_t family, int units);
+
+// Free dynamically allocated memory. A block of another thread's heap is handed back to that thread,
+// which frees it on its next xcalloc. A block of an exited thread's heap is freed at once.
 void xfree(void *ptr);
 
-// Allocate memory from shared memory pools
+// Allocate memory from the storage manager's pools. They are private to the process; pools which
+// several processes can map are created with SM_shared_create from sm_shared.h.
 void *SM_alloc(size_t size);
 
-// Deallocate memory allocated from shared memory pools
+// Deallocate memory allocated from the storage manager's pools
 void SM_dealloc(void *ptr);
 
+// Allocate count blocks of the same size with one pool lookup. Returns the number allocated.
+unsigned int SM_alloc_batch(size_t size, unsigned int count, void **out);
+
+// Deallocate count blocks, splicing blocks of the same pool into its free list at once
+void SM_dealloc_batch(void **ptrs, unsigned int count);
+
 
 
 
@@ -44,8 +58,12 @@ void handle_fault_or_violation(int error_code, int virtual_page_number);
 // Initialize memory management system
 void mm_init();
 
-// Register a new page family for memory management
-void mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+// Register a new page family for memory management. Returns its handle, the handle already registered
+// under struct_name if its size matches, or NULL on error.
+mm_page_family_handle_t mm_instantiate_new_page_family(char *struct_name, uint32_t struct_size);
+
+// Handle of the page family registered under struct_name, or NULL
+mm_page_family_handle_t lookup_page_family_by_name(char *struct_name);
 
 // Print memory usage statistics for a specific page family
 void mm_print_memory_usage(char *struct_name);
@@ -56,4 +74,7 @@ void mm_print_registered_page_families();
 // Print block usage statistics
 void mm_print_block_usage();
 
+// Unmap the empty VM pages kept for reuse by the calling thread and in the global page cache
+void mm_trim_retained_pages();
+
 #endif /* MMAP_API_H */
\ No newline at end of file